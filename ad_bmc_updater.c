@@ -25,70 +25,68 @@
 #include <fcntl.h>
 #include <unistd.h>
 #include <errno.h>
+#include <poll.h>
 #include <getopt.h>
 #include <sys/ioctl.h>
 #include <linux/i2c-dev.h>
 #include "flash.h"
 #include "bmc_update_lib.h"
 
-extern uint8_t  g_pui8Buffer[256];
+extern void internal_delay(unsigned int usecs);
+extern uint64_t internal_time_usecs(void);
 //@bmcflash.exe cSL2v9.bin -a 0x50 -p 0x2000 -s 0x1c -r 0x2004 -c 1
 //
-static uint32_t g_ui32DownloadAddress = 0x2000;
-static uint32_t g_ui32StartAddress = 0x2004;
-uint32_t g_BlockTransferSize = 0x1c;
 
-int32_t RunBMCUpdater(FILE *hApplFile)	//Application only
+int32_t RunBMCUpdater(struct bmc_context *psCtx, FILE *hApplFile)	//Application only
 {
+    struct bmc_wait sWait;
+    struct pollfd sPollFd;
+    enum bmc_step eStep;
+    uint64_t ui64Now;
+
     // Only program application part.
 
     //
-    // Jump to the boot loader.
+    // Run the update of StepUpdate() and sleep through every wait it asks
+    // for.
     //
-    g_pui8Buffer[0] = COMMAND_ENTER_BOOTLOADER;
-    if(EnterBootloader(g_pui8Buffer, 1) < 0)
+    if(StartUpdate(psCtx, hApplFile) < 0)
     {
         return(-1);
     }
-
-	if(UpdateFlash(hApplFile, 0, g_ui32DownloadAddress) < 0)
+    while((eStep = StepUpdate(psCtx, &sWait)) != BMC_STEP_DONE)
     {
-        return(-1);
+        if(eStep == BMC_STEP_WAIT_FD)
+        {
+            sPollFd.fd = sWait.fd;
+            sPollFd.events = POLLIN;
+            if(poll(&sPollFd, 1, -1) < 0 && errno != EINTR)
+            {
+                AbortUpdate(psCtx);
+                return(-1);
+            }
+            continue;
+        }
+        ui64Now = internal_time_usecs();
+        if(sWait.deadline_us > ui64Now)
+        {
+            internal_delay(sWait.deadline_us - ui64Now);
+        }
     }
+    return(sWait.result);
+}
 
-    //
-    // If a start address was specified then send the run command to the
-    // boot loader.
-    //
-    if(g_ui32StartAddress != 0xffffffff)
-    {
-        //
-        // Send the run command but just send the packet, there will likely
-        // be no boot loader to answer after this command completes.
-        //
-        g_pui8Buffer[0] = COMMAND_RUN;
-        g_pui8Buffer[1] = (uint8_t)(g_ui32StartAddress>>24);
-        g_pui8Buffer[2] = (uint8_t)(g_ui32StartAddress>>16);
-        g_pui8Buffer[3] = (uint8_t)(g_ui32StartAddress>>8);
-        g_pui8Buffer[4] = (uint8_t)g_ui32StartAddress;
-        SendPacket(g_pui8Buffer, 5, 1);
-        msg_pinfo("Running from address %08x\n",g_ui32StartAddress);
-    }
-    else
-    {
-        //
-        // Send the reset command but just send the packet, there will likely
-        // be no boot loader to answer after this command completes.
-        //
-        g_pui8Buffer[0] = COMMAND_RESET;
-        SendPacket(g_pui8Buffer, 1, 1);
-        msg_pinfo("Send Reset command\n");
-    }
-    if(hApplFile != 0)
+//
+// Write the packet file for an application image, framed for the download
+// address and block size of psCtx, or the safe block size if that is 0.
+//
+int32_t PrepareBMCImage(struct bmc_context *psCtx, FILE *hApplFile, FILE *hPacketFile)
+{
+    uint32_t ui32BlockSize = psCtx->block_size;
+
+    if(ui32BlockSize == 0)
     {
-        fclose(hApplFile);
+        ui32BlockSize = SAFE_BLOCK_TRANSFER_SIZE;
     }
-    msg_pinfo("Successfully downloaded to device.\n");
-    return(0);	
+    return(PrepareImage(hApplFile, hPacketFile, psCtx->download_address, ui32BlockSize));
 }
-
@@ -22,6 +22,10 @@
 #include <ctype.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/file.h>
+#include <pthread.h>
+#include <poll.h>
 #include <fcntl.h>
 #include <unistd.h>
 #include <errno.h>
@@ -31,66 +35,262 @@
 #include "flash.h"
 #include "bmc_update_lib.h"
 
-extern int32_t I2CSendData(uint8_t const *pui8Data, uint8_t ui8Size);
-extern int32_t I2CReceiveData(uint8_t *pui8Data, uint8_t ui8Size);
-extern int32_t I2CEnterBootloader(uint8_t *pui8Command, uint8_t ui8Size);
+extern void internal_delay(unsigned int usecs);
+extern uint64_t internal_time_usecs(void);
 
-extern void delay(uint32_t mills);
-extern uint32_t g_BlockTransferSize;
+/* TivaC flash erase granularity. */
+#define FLASH_PAGE_SIZE     0x400
+/* How often a streamed transfer may restart before giving up. */
+#define MAX_REWINDS         3
+/* Time the application needs to exit and start the boot loader. */
+#define BOOTLOADER_START_MS 400
 
-uint8_t  g_pui8Buffer[256];
-uint32_t g_ui32FileLength;
+//
+// A range of the transfer that is erased with one DOWNLOAD, and programmed
+// unless it is to read as erased.
+//
+typedef struct
+{
+    uint32_t ui32Start;
+    uint32_t ui32Length;
+    bool bProgram;          /* false if the range only needs erasing */
+    const uint8_t *pui8Frames;  /* SEND_DATA frames of the range, or 0 */
+}
+tTransferWindow;
 
-//****************************************************************************
 //
-//! EnterBootloader() sends a command to the serial boot loader.
-//!
-//! \param pui8Command is the unformatted command to send to the device.
-//! \param ui8Size is the size, in bytes, of the command to be sent.
-//!
-//! This function will send a command to the device and read back the status
-//! code from the device to see if the command completed successfully.
-//!
-//! \return If any part of the function fails, the function will return a
-//!     negative error code.  The function will return 0 to indicate success.
+// A packet file, written by PrepareImage(), holds an image together with
+// the SEND_DATA frames for it. It starts with this header, in host byte
+// order, followed by ui32Windows tPacketFileWindow entries. The image and
+// the frames come after that. Frame n of a range sits at ui32FrameOffset +
+// n * (ui32BlockSize + 3), so frames can be sent straight from a mapping.
 //
-//****************************************************************************
-int32_t
-EnterBootloader(uint8_t *pui8Command, uint8_t ui8Size)
+#define PACKET_FILE_MAGIC   "BMCPKT2"
+#define PACKET_FILE_MAGIC_1 "BMCPKT1"   /* the same without pui8Digest */
+
+typedef struct
 {
-    uint8_t ui8Status;
-	if(I2CEnterBootloader(pui8Command, ui8Size)<0) {
-		msg_pinfo("Failed to Enter Bootloader FRU Mode\n");
-        return(-1);
+    char pcMagic[8];
+    uint32_t ui32BlockSize;
+    uint32_t ui32Address;
+    uint32_t ui32ImageLength;
+    uint32_t ui32ImageOffset;
+    uint32_t ui32Windows;
+    uint8_t pui8Digest[32];     /* SHA-256 of the image */
+}
+tPacketFileHeader;
+
+typedef struct
+{
+    uint32_t ui32Start;
+    uint32_t ui32Length;
+    uint32_t ui32Program;
+    uint32_t ui32FrameOffset;
+}
+tPacketFileWindow;
+
+//
+// A packet file mapped by OpenPacketFile(), if the update is one.
+//
+typedef struct
+{
+    uint8_t *pui8Map;
+    uint32_t ui32MapLength;
+    tPacketFileHeader sHeader;
+}
+tPacketFile;
+
+//
+// An update loaded by LoadUpdate(), ready for StepUpdate() to send.
+//
+typedef struct
+{
+    FILE *hFile;
+    FILE *hBootFile;
+    uint32_t ui32Address;
+    int32_t i32Result;
+    tPacketFile sPacketFile;
+    uint8_t *pui8Image;
+    uint32_t ui32ImageLength;
+    bool bMapped;
+    uint32_t ui32TransferStart;
+    uint32_t ui32TransferLength;
+    tTransferWindow *psWindows;
+    int32_t i32Windows;
+    uint8_t *pui8Frames;        /* frames built by LoadUpdate(), or 0 */
+    uint32_t ui32FramesLength;
+    uint32_t ui32FrameBlock;    /* block size of the frames, or 0 if none */
+}
+tUpdate;
+
+//
+// An update PreloadUpdate() is loading, and the thread it runs on. It
+// belongs to the context until StepUpdate() or CancelPreload() takes it.
+//
+struct bmc_preload
+{
+    struct bmc_context *psCtx;
+    tUpdate sUpdate;
+    pthread_t hThread;
+    int piDone[2];              /* pipe, readable once the update is loaded */
+};
+
+//
+// A wait for the boot loader to answer, see StartPoll().
+//
+typedef struct
+{
+    enum bmc_poll_type ePoll;
+    uint8_t *pui8Data;
+    uint8_t ui8Size;
+    uint64_t ui64Deadline;
+    uint64_t ui64Next;          /* when to look again */
+    uint32_t ui32Interval;
+}
+tPoll;
+
+static int32_t PollResponse(struct bmc_context *psCtx, enum bmc_poll_type ePoll,
+                            uint8_t *pui8Data, uint8_t ui8Size, uint32_t ui32WaitUs);
+uint8_t CheckSum(uint8_t *pui8Data, uint8_t ui8Size);
+static void UnloadUpdate(tUpdate *psUpdate);
+static void CancelPreload(struct bmc_context *psCtx);
+
+static const struct bmc_poll_policy g_psDefaultPollPolicy[BMC_POLL_TYPES] = {
+    [BMC_POLL_COMMAND] = { .initial_us = 100, .max_us = 5000,  .deadline_ms = 1000 },
+    [BMC_POLL_ERASE]   = { .initial_us = 200, .max_us = 2000,  .deadline_ms = 10000 },
+    [BMC_POLL_PROGRAM] = { .initial_us = 50,  .max_us = 2000,  .deadline_ms = 500 },
+    [BMC_POLL_STATUS]  = { .initial_us = 100, .max_us = 5000,  .deadline_ms = 1000 },
+};
+
+static const char * const g_ppcPollName[BMC_POLL_TYPES] = {
+    [BMC_POLL_COMMAND] = "command ACK",
+    [BMC_POLL_ERASE]   = "erase ACK",
+    [BMC_POLL_PROGRAM] = "program ACK",
+    [BMC_POLL_STATUS]  = "status packet",
+};
+
+/* Fill in the defaults of every tunable and clear the statistics. */
+void bmc_context_init(struct bmc_context *ctx)
+{
+	memset(ctx, 0, sizeof(*ctx));
+	ctx->status_interval = 16;
+	memcpy(ctx->poll_policy, g_psDefaultPollPolicy, sizeof(ctx->poll_policy));
+	ctx->show_progress = true;
+	ctx->download_address = BMC_DOWNLOAD_ADDRESS;
+	ctx->start_address = BMC_START_ADDRESS;
+}
+
+int register_bmc_transport(struct bmc_context *ctx, const struct bmc_transport *transport,
+			   void *data)
+{
+	if (ctx->transport) {
+		msg_perr("%s: transport %s already registered, refusing %s.\n",
+			 __func__, ctx->transport->name, transport->name);
+		return ERROR_FLASHROM_BUG;
 	}
-    //
-    // Send the get status command to tell the device to return status to
-    // the host.
-    //
- 
-    ui8Status = COMMAND_GET_STATUS;
-    if(SendPacket(&ui8Status, 1, 1) < 0)
+	if (!transport->send_data || !transport->receive_data ||
+	    !transport->enter_bootloader) {
+		msg_perr("%s: transport %s is incomplete.\n", __func__, transport->name);
+		return ERROR_FLASHROM_BUG;
+	}
+	ctx->transport = transport;
+	ctx->transport_data = data;
+	if (!ctx->device[0])
+		snprintf(ctx->device, sizeof(ctx->device), "%s", transport->name);
+	msg_pdbg("Using %s transport.\n", transport->name);
+	return 0;
+}
+
+int bmc_transport_shutdown(struct bmc_context *ctx)
+{
+	const struct bmc_transport *transport = ctx->transport;
+
+	AbortUpdate(ctx);
+	CancelPreload(ctx);
+	ctx->transport = NULL;
+	if (transport && transport->shutdown)
+		return transport->shutdown(ctx->transport_data);
+	return 0;
+}
+
+static int32_t
+TransportSendData(struct bmc_context *psCtx, uint8_t const *pui8Data, uint8_t ui8Size)
+{
+    if(!psCtx->transport)
     {
-        msg_pinfo("Failed to Get Bootloader Status\n");
         return(-1);
     }
-    //
-    // Read back the status provided from the device.
-    //
-    ui8Size = sizeof(ui8Status);
-    if(GetPacket(&ui8Status, &ui8Size) < 0)
+    psCtx->stats.writes++;
+    psCtx->stats.round_trips++;
+    psCtx->stats.bytes_written += ui8Size;
+    return(psCtx->transport->send_data(psCtx->transport_data, pui8Data, ui8Size));
+}
+
+static int32_t
+TransportReceiveData(struct bmc_context *psCtx, uint8_t *pui8Data, uint8_t ui8Size)
+{
+    if(!psCtx->transport)
     {
+        return(-1);
+    }
+    psCtx->stats.reads++;
+    psCtx->stats.round_trips++;
+    return(psCtx->transport->receive_data(psCtx->transport_data, pui8Data, ui8Size));
+}
 
-        msg_pinfo("Failed to Get Bootloader Packet\n");
+static int32_t
+TransportExchange(struct bmc_context *psCtx, uint8_t const *pui8Out, uint8_t ui8OutSize,
+                  uint8_t *pui8In, uint8_t ui8InSize)
+{
+    if(!psCtx->transport)
+    {
         return(-1);
     }
-    return(0);
+    if(!psCtx->transport->exchange)
+    {
+        if(TransportSendData(psCtx, pui8Out, ui8OutSize))
+        {
+            return(-1);
+        }
+        return(TransportReceiveData(psCtx, pui8In, ui8InSize));
+    }
+    psCtx->stats.writes++;
+    psCtx->stats.reads++;
+    psCtx->stats.round_trips++;
+    psCtx->stats.bytes_written += ui8OutSize;
+    return(psCtx->transport->exchange(psCtx->transport_data, pui8Out, ui8OutSize,
+                                   pui8In, ui8InSize));
+}
+
+static int32_t
+TransportReadVersion(struct bmc_context *psCtx, uint8_t *pui8Data, uint8_t ui8Size)
+{
+    if(!psCtx->transport || !psCtx->transport->read_version)
+    {
+        return(-1);
+    }
+    psCtx->stats.reads++;
+    psCtx->stats.round_trips++;
+    return(psCtx->transport->read_version(psCtx->transport_data, pui8Data, ui8Size));
+}
+
+static int32_t
+TransportEnterBootloader(struct bmc_context *psCtx, uint8_t *pui8Command, uint8_t ui8Size)
+{
+    if(!psCtx->transport)
+    {
+        return(-1);
+    }
+    psCtx->stats.writes++;
+    psCtx->stats.round_trips++;
+    return(psCtx->transport->enter_bootloader(psCtx->transport_data, pui8Command, ui8Size));
 }
 
 //****************************************************************************
 //
 //! SendCommand() sends a command to the serial boot loader.
 //!
+//! \param psCtx is the update context.
 //! \param pui8Command is the properly formatted serial flash loader command to
 //!     send to the device.
 //! \param ui8Size is the size, in bytes, of the command to be sent.
@@ -103,24 +303,46 @@ EnterBootloader(uint8_t *pui8Command, uint8_t ui8Size)
 //
 //****************************************************************************
 int32_t
-SendCommand(uint8_t *pui8Command, uint8_t ui8Size)
+SendCommand(struct bmc_context *psCtx, uint8_t *pui8Command, uint8_t ui8Size)
 {
-    uint8_t ui8Status;
-
     //
     // Send the command itself.
     //
-    if(SendPacket(pui8Command, ui8Size, 1) < 0)
+    if(SendPacket(psCtx, pui8Command, ui8Size, 1) < 0)
     {
         return(-1);
     }
 
+    return(CheckStatus(psCtx));
+}
+
+//****************************************************************************
+//
+//! CheckStatus() asks the boot loader how the last command went.
+//!
+//! \param psCtx is the update context.
+//!
+//! This function sends COMMAND_GET_STATUS and reads back the status packet.
+//! The boot loader keeps a failed status until the next DOWNLOAD, so this
+//! also reports a failure of any earlier command that was not checked.
+//!
+//! \return If any part of the function fails or the status is not
+//!     COMMAND_RET_SUCCESS, the function will return a negative error code.
+//!     The function will return 0 to indicate success.
+//
+//****************************************************************************
+int32_t
+CheckStatus(struct bmc_context *psCtx)
+{
+    uint8_t ui8Status;
+    uint8_t ui8Size;
+
     //
     // Send the get status command to tell the device to return status to
     // the host.
     //
     ui8Status = COMMAND_GET_STATUS;
-    if(SendPacket(&ui8Status, 1, 1) < 0)
+    if(SendPacket(psCtx, &ui8Status, 1, 1) < 0)
     {
         msg_pinfo("\nFailed to Get Status");
         return(-1);
@@ -130,7 +352,7 @@ SendCommand(uint8_t *pui8Command, uint8_t ui8Size)
     // Read back the status provided from the device.
     //
     ui8Size = sizeof(ui8Status);
-    if(GetPacket(&ui8Status, &ui8Size) < 0)
+    if(GetPacket(psCtx, &ui8Status, &ui8Size) < 0)
     {
         msg_pinfo("\nFailed to Get Packet");
         return(-1);
@@ -145,219 +367,1719 @@ SendCommand(uint8_t *pui8Command, uint8_t ui8Size)
 
 //*****************************************************************************
 //
-//! UpdateFlash() programs data to the flash.
+//! MaxBlockSize() returns the largest data block the transport can carry.
 //!
-//! \param hFile is an open file pointer to the binary data to program into the
-//!     flash as the application.
-//! \param hBootFile is an open file pointer to the binary data for the
-//!     boot loader binary.  This will be programmed at offset zero.
-//! \param ui32Address is address to start programming data to the falsh.
+//! \param psCtx is the update context.
 //!
-//! This routine handles the commands necessary to program data to the flash.
-//! If hFile should always have a value if hBootFile also has a valid value.
-//! This function will concatenate the two files in memory to reduce the number
-//! of flash erases that occur when both the boot loader and the application
-//! are being updated.
-//!
-//! \return This function either returns a negative value indicating a failure
-//!     or zero if the update was successful.
+//! The boot loader may still take less, StepUpdate() finds out how much.
 //
 //*****************************************************************************
-int32_t
-UpdateFlash(FILE *hFile, FILE *hBootFile, uint32_t ui32Address)
+static uint32_t
+MaxBlockSize(struct bmc_context *psCtx)
 {
-    uint32_t ui32BootFileLength;
-    uint32_t ui32TransferStart;
-    uint32_t ui32TransferLength;
-    uint8_t *pui8FileBuffer;
-    uint8_t fsegment = 0;                     /* actual processed 32kB file segment */
-    uint32_t ui32FileBufferLength = (FILE_BUFFER_LENGTH / g_BlockTransferSize) * g_BlockTransferSize;
-    uint32_t ui32Offset;
-    uint32_t TotalLength;
+    uint32_t ui32Max;
+    uint32_t ui32Block;
+
+    ui32Max = 32;
+    if(psCtx->transport && psCtx->transport->max_transfer)
+    {
+        ui32Max = psCtx->transport->max_transfer;
+    }
 
     //
-    // At least one file must be specified.
+    // Framed packets carry size and checksum in the same write, legacy
+    // ones only the command byte.
     //
-    if(hFile == 0)
+    ui32Block = ui32Max - (psCtx->legacy_framing ? 1 : 3);
+    if(ui32Block > MAX_BLOCK_TRANSFER_SIZE)
     {
-        return(-1);
+        ui32Block = MAX_BLOCK_TRANSFER_SIZE;
     }
+    ui32Block &= ~3;
+
+    return(ui32Block);
+}
+
+//*****************************************************************************
+//
+//! ReadVersion() reads the version text of the running application.
+//!
+//! \param psCtx is the update context.
+//! \param pcVersion receives the text, not terminated.
+//! \param ui32Size is the size of pcVersion.
+//!
+//! The running application reports its version as a text block. Trailing
+//! padding is dropped, and replies that are not printable, too short to
+//! identify a build or too long for pcVersion are ignored.
+//!
+//! \return This function returns the length of the text, or a negative value
+//!     if the transport or the application has none.
+//
+//*****************************************************************************
+int32_t
+ReadVersion(struct bmc_context *psCtx, char *pcVersion, uint32_t ui32Size)
+{
+    uint8_t pui8Reply[255];
+    int32_t i32Length;
+    int32_t i;
 
     //
-    // Get the file sizes.
+    // Transports cut the reply to the buffer they are given, so read it
+    // whole and refuse to hand out a cut version.
     //
-    fseek(hFile, 0, SEEK_END);
-    g_ui32FileLength = ftell(hFile);
-    fseek(hFile, 0, SEEK_SET);
-    /*
-    if((g_pcFilename == g_pcBootLoadName) && g_ui32FileLength > 0x2000)
+    i32Length = TransportReadVersion(psCtx, pui8Reply, sizeof(pui8Reply));
+    if(i32Length <= 0 || i32Length >= (int32_t)sizeof(pui8Reply))
     {
-        msg_pinfo("Bootloader file is too big\n");
         return(-1);
     }
-    */
 
     //
-    // Default the transfer length to be the size of the application.
+    // Trailing padding is not part of the version.
     //
-    ui32TransferLength = g_ui32FileLength;
-    ui32TransferStart = ui32Address;
-
-    if(hBootFile)
+    while(i32Length && (pui8Reply[i32Length - 1] == 0 || pui8Reply[i32Length - 1] == 0xff ||
+                        isspace(pui8Reply[i32Length - 1])))
     {
-        fseek(hBootFile, 0, SEEK_END);
-        ui32BootFileLength = ftell(hBootFile);
-        fseek(hBootFile, 0, SEEK_SET);
-
-        if(ui32BootFileLength != 0x2000)
+        i32Length--;
+    }
+    for(i = 0; i < i32Length; i++)
+    {
+        if(!isprint(pui8Reply[i]))
         {
-            msg_pinfo("Wrong Bootloader file size (need exactly 8192 bytes).\n");
             return(-1);
         }
-
-        ui32TransferLength = ui32Address + g_ui32FileLength;
-        ui32TransferStart = 0;
     }
-    else if(g_ui32FileLength == 0x2000 && ui32Address != 0x0000)
+    if(i32Length < 4 || (uint32_t)i32Length > ui32Size)
     {
-        msg_pinfo("Bootloader file must be programmed with -l option.\n");
         return(-1);
     }
+    memcpy(pcVersion, pui8Reply, i32Length);
+    return(i32Length);
+}
 
-    pui8FileBuffer = malloc(ui32FileBufferLength);
-    if(pui8FileBuffer == 0)
-    {
-        msg_pinfo("No Memory to allocate Buffer.\n");
-        return(-1);
-    }
+//*****************************************************************************
+//
+//! MatchVersion() tells whether an image carries a version text.
+//!
+//! \param pui8Image is the image.
+//! \param ui32ImageLength is the length of the image.
+//! \param pcVersion is the text ReadVersion() got from the running firmware.
+//! \param i32Length is the length of the text.
+//!
+//! The SEMA firmware keeps its version text as a string of its own, between
+//! bytes that are not printable, so only a match that fills such a string
+//! counts. "V1.2.3" then matches neither "V11.2.3" nor "V1.2.34", nor a
+//! mention like "upgrade from V1.2.3". Trailing spaces are allowed, since
+//! ReadVersion() drops them.
+//!
+//! \return This function returns true if the image carries the text.
+//
+//*****************************************************************************
+static bool
+MatchVersion(const uint8_t *pui8Image, uint32_t ui32ImageLength, const char *pcVersion,
+             int32_t i32Length)
+{
+    uint32_t i, ui32End;
 
-    if(hBootFile)
+    for(i = 0; i + i32Length <= ui32ImageLength; i++)
     {
-        if(fread(pui8FileBuffer, sizeof(uint8_t), ui32BootFileLength, hBootFile) !=
-            ui32BootFileLength)
+        if(pui8Image[i] != (uint8_t)pcVersion[0] || (i && isprint(pui8Image[i - 1])) ||
+           memcmp(&pui8Image[i], pcVersion, i32Length))
         {
-            return(-1);
+            continue;
         }
-
-        if(ui32Address < ui32BootFileLength)
+        for(ui32End = i + i32Length; ui32End < ui32ImageLength && pui8Image[ui32End] == ' ';
+            ui32End++)
         {
-            return(-1);
         }
-
-        //
-        // Pad the unused code space with 0xff to have all of the flash in
-        // a known state.
-        //
-        memset(&pui8FileBuffer[ui32BootFileLength], 0xff,
-            ui32Address - ui32BootFileLength);
-
-        //
-        // Append the application to the boot loader image.
-        //
-        if(!fread(&pui8FileBuffer[ui32Address], sizeof(uint8_t), ui32FileBufferLength-ui32Address, hFile))
+        if(ui32End == ui32ImageLength || !isprint(pui8Image[ui32End]))
         {
-            return(-1);
+            return(true);
         }
     }
-    else
+    return(false);
+}
+
+//*****************************************************************************
+//
+//! DownloadPages() returns the number of flash pages a DOWNLOAD erases.
+//!
+//! \param ui32Start is the flash address of the first byte to program.
+//! \param ui32Length is the number of bytes that will be programmed.
+//
+//*****************************************************************************
+static uint32_t
+DownloadPages(uint32_t ui32Start, uint32_t ui32Length)
+{
+    return((ui32Start + ui32Length + FLASH_PAGE_SIZE - 1) / FLASH_PAGE_SIZE -
+           ui32Start / FLASH_PAGE_SIZE);
+}
+
+//*****************************************************************************
+//
+//! WriteDownload() puts COMMAND_DOWNLOAD on the bus.
+//!
+//! \param psCtx is the update context.
+//! \param ui32Start is the flash address of the first byte to program.
+//! \param ui32Length is the number of bytes that will be programmed.
+//! \param pui32WaitUs receives how long to wait before polling for the ACK.
+//!
+//! The boot loader erases every page the range touches before it ACKs.
+//! The wait covers most of the erase time learned so far, or is 0 if nothing
+//! has been learned.
+//!
+//! \return This function returns a negative value on failure and zero on
+//!     success.
+//
+//*****************************************************************************
+static int32_t
+WriteDownload(struct bmc_context *psCtx, uint32_t ui32Start, uint32_t ui32Length,
+              uint32_t *pui32WaitUs)
+{
+    psCtx->buffer[0] = COMMAND_DOWNLOAD;
+    psCtx->buffer[1] = (uint8_t)(ui32Start >> 24);
+    psCtx->buffer[2] = (uint8_t)(ui32Start >> 16);
+    psCtx->buffer[3] = (uint8_t)(ui32Start >> 8);
+    psCtx->buffer[4] = (uint8_t)ui32Start;
+    psCtx->buffer[5] = (uint8_t)(ui32Length>>24);
+    psCtx->buffer[6] = (uint8_t)(ui32Length>>16);
+    psCtx->buffer[7] = (uint8_t)(ui32Length>>8);
+    psCtx->buffer[8] = (uint8_t)ui32Length;
+    if(SendPacket(psCtx, psCtx->buffer, 9, 0) < 0)
     {
-        //
-        // Just read in one image (bootloader or application)
-        //
-        if(!fread(pui8FileBuffer, sizeof(uint8_t), ui32FileBufferLength, hFile))
-        {
-            return(-1);
-        }
+        return(-1);
     }
+    *pui32WaitUs = (uint64_t)psCtx->erase_page_us * DownloadPages(ui32Start, ui32Length) * 7 / 8;
+    return(0);
+}
 
+//*****************************************************************************
+//
+//! LearnEraseTime() updates the erase time per page of psCtx.
+//!
+//! \param psCtx is the update context.
+//! \param ui32Start is the flash address the DOWNLOAD started at.
+//! \param ui32Length is the length of the DOWNLOAD.
+//! \param ui64Erase is the time from the DOWNLOAD to its ACK, in microseconds.
+//
+//*****************************************************************************
+static void
+LearnEraseTime(struct bmc_context *psCtx, uint32_t ui32Start, uint32_t ui32Length,
+               uint64_t ui64Erase)
+{
+    uint32_t ui32Pages, ui32PageUs;
+
+    ui32Pages = DownloadPages(ui32Start, ui32Length);
+    if(ui32Pages == 0)
+    {
+        return;
+    }
+    ui32PageUs = ui64Erase / ui32Pages;
+    msg_pdbg("Erased %u pages in %u us, %u us per page.\n", ui32Pages,
+             (uint32_t)ui64Erase, ui32PageUs);
     //
-    // Build up the download command and send it to the board.
+    // Small erases are dominated by the polling granularity, so let the
+    // larger ones weigh in more.
     //
-    g_pui8Buffer[0] = COMMAND_DOWNLOAD;
-    g_pui8Buffer[1] = (uint8_t)(ui32TransferStart >> 24);
-    g_pui8Buffer[2] = (uint8_t)(ui32TransferStart >> 16);
-    g_pui8Buffer[3] = (uint8_t)(ui32TransferStart >> 8);
-    g_pui8Buffer[4] = (uint8_t)ui32TransferStart;
-    g_pui8Buffer[5] = (uint8_t)(ui32TransferLength>>24);
-    g_pui8Buffer[6] = (uint8_t)(ui32TransferLength>>16);
-    g_pui8Buffer[7] = (uint8_t)(ui32TransferLength>>8);
-    g_pui8Buffer[8] = (uint8_t)ui32TransferLength;
-    if(SendCommand(g_pui8Buffer, 9) < 0)
+    if(psCtx->erase_page_us == 0)
     {
-        msg_pinfo("\nFailed to Send Download Command\n");
-        msg_pinfo("Flash might be erased\n");
-        return(-1);
+        psCtx->erase_page_us = ui32PageUs;
     }
     else
     {
-        msg_pinfo("Flash erased\n");
+        psCtx->erase_page_us = ((uint64_t)psCtx->erase_page_us * 3 + ui32PageUs) / 4;
     }
+}
 
-    ui32Offset = 0;
-    TotalLength = ui32TransferLength;
+//*****************************************************************************
+//
+//! LoadEraseTiming() looks up the learned erase time of a device.
+//!
+//! \param psCtx is the update context.
+//! \param pcPath is the file holding one "device microseconds-per-page" line
+//!     per device.
+//!
+//! A missing file or device leaves the erase time of psCtx untouched.
+//
+//*****************************************************************************
+void
+LoadEraseTiming(struct bmc_context *psCtx, const char *pcPath)
+{
+    char pcLine[512], pcName[480];
+    unsigned int uiPageUs;
+    FILE *hFile;
 
-    msg_pinfo("Remaining Bytes: ");
-    do
+    hFile = fopen(pcPath, "r");
+    if(hFile == NULL)
     {
-        uint8_t ui8BytesSent;
-
-        g_pui8Buffer[0] = COMMAND_SEND_DATA;
-
-        msg_pinfo("%08d (%02d%%)", ui32TransferLength, (TotalLength-ui32TransferLength)*100/TotalLength);
-
-        //
-        // Send out 8 bytes at a time to throttle download rate and avoid
-        // overruning the device since it is programming flash on the fly.
-        //
-        if(ui32TransferLength >= g_BlockTransferSize)
-        {
-            memcpy(&g_pui8Buffer[1], &pui8FileBuffer[ui32Offset-fsegment*ui32FileBufferLength], g_BlockTransferSize);
-            ui32Offset += g_BlockTransferSize;
-            ui32TransferLength -= g_BlockTransferSize;
-            ui8BytesSent = g_BlockTransferSize + 1;
-        }
-        else
-        {
-            memcpy(&g_pui8Buffer[1], &pui8FileBuffer[ui32Offset-fsegment*ui32FileBufferLength], ui32TransferLength);
-            ui32Offset += ui32TransferLength;
-            ui8BytesSent = ui32TransferLength + 1;
-            ui32TransferLength = 0;
-        }
-        //
-        // Send the Send Data command to the device.
-        //
-        if(SendCommand(g_pui8Buffer, ui8BytesSent) < 0)
-        {
-            msg_pinfo("\nFailed to Send Packet data\n");
-            return(-1);
-        }
-
-        // Read next 32k bytes
-        if(ui32Offset + g_BlockTransferSize > ui32FileBufferLength*(fsegment+1))
+        return;
+    }
+    while(fgets(pcLine, sizeof(pcLine), hFile))
+    {
+        if(sscanf(pcLine, "%479s %u", pcName, &uiPageUs) == 2 &&
+           !strcmp(pcName, psCtx->device))
         {
-            if(fread(pui8FileBuffer, sizeof(uint8_t), ui32FileBufferLength, hFile) )
-                fsegment++;
+            psCtx->erase_page_us = uiPageUs;
+            msg_pdbg("Learned erase time of %s is %u us per page.\n",
+                     psCtx->device, uiPageUs);
         }
-        
-        msg_pinfo("\b\b\b\b\b\b\b\b\b\b\b\b\b\b");
-    } while (ui32TransferLength);
-    msg_pinfo("00000000 (100%%)\n\r");
-
-    if(pui8FileBuffer)
-    {
-        free(pui8FileBuffer);
     }
-    return(0);
+    fclose(hFile);
 }
 
+//*****************************************************************************
+//
+//! SaveEraseTiming() stores the erase time psCtx learned for its device.
+//!
+//! \param psCtx is the update context.
+//! \param pcPath is the file written by earlier runs, see LoadEraseTiming().
+//!
+//! Lines of other devices are kept. The file is replaced atomically so that
+//! concurrent runs never see it half written.
+//!
+//! \return This function returns a negative value on failure and zero on
+//!     success.
+//
+//*****************************************************************************
+int32_t
+SaveEraseTiming(struct bmc_context *psCtx, const char *pcPath)
+{
+    char pcLine[512], pcName[480], *pcTemp;
+    FILE *hFile, *hTemp;
+    size_t len;
+    int fd, iLock;
+    int32_t i32Ret = 0;
+
+    if(psCtx->erase_page_us == 0)
+    {
+        return(0);
+    }
+    len = strlen(pcPath) + sizeof(".XXXXXX");
+    pcTemp = malloc(len);
+    if(pcTemp == NULL)
+    {
+        return(-1);
+    }
+
+    //
+    // Updates running side by side may save at the same time. Hold a lock
+    // next to the file while it is rewritten so no entry gets lost.
+    //
+    snprintf(pcTemp, len, "%s.lock", pcPath);
+    iLock = open(pcTemp, O_RDWR | O_CREAT, 0600);
+    if(iLock >= 0)
+    {
+        flock(iLock, LOCK_EX);
+    }
+
+    snprintf(pcTemp, len, "%s.XXXXXX", pcPath);
+    hTemp = NULL;
+    fd = mkstemp(pcTemp);
+    if(fd >= 0)
+    {
+        hTemp = fdopen(fd, "w");
+    }
+    if(hTemp == NULL)
+    {
+        msg_pdbg("Cannot store the erase time in %s: %s\n", pcPath, strerror(errno));
+        if(fd >= 0)
+        {
+            close(fd);
+            unlink(pcTemp);
+        }
+        if(iLock >= 0)
+        {
+            close(iLock);
+        }
+        free(pcTemp);
+        return(-1);
+    }
+
+    hFile = fopen(pcPath, "r");
+    if(hFile != NULL)
+    {
+        while(fgets(pcLine, sizeof(pcLine), hFile))
+        {
+            if(sscanf(pcLine, "%479s", pcName) == 1 && strcmp(pcName, psCtx->device))
+            {
+                fputs(pcLine, hTemp);
+            }
+        }
+        fclose(hFile);
+    }
+    fprintf(hTemp, "%s %u\n", psCtx->device, psCtx->erase_page_us);
+    if(fclose(hTemp) || rename(pcTemp, pcPath))
+    {
+        msg_pdbg("Cannot store the erase time in %s: %s\n", pcPath, strerror(errno));
+        unlink(pcTemp);
+        i32Ret = -1;
+    }
+    if(iLock >= 0)
+    {
+        close(iLock);
+    }
+    free(pcTemp);
+    return(i32Ret);
+}
+
+//*****************************************************************************
+//
+//! MapFile() maps the start of a file read-only and keeps it in memory.
+//!
+//! \param hFile is the file.
+//! \param ui32Length is the number of bytes to map.
+//!
+//! The whole range is read in right away and locked if the limits allow, so
+//! the transfer never waits for the file system, e.g. an NFS server, or for
+//! pages evicted while the host is busy. This is done while the image is
+//! loaded, ahead of the bus traffic.
+//!
+//! \return This function returns the mapping, or NULL if the file cannot be
+//!     mapped.
+//
+//*****************************************************************************
+static uint8_t *
+MapFile(FILE *hFile, uint32_t ui32Length)
+{
+    uint8_t *pui8Map;
+    int iFlags = MAP_PRIVATE;
+
+#ifdef MAP_POPULATE
+    iFlags |= MAP_POPULATE;
+#endif
+    pui8Map = mmap(NULL, ui32Length, PROT_READ, iFlags, fileno(hFile), 0);
+    if(pui8Map == MAP_FAILED)
+    {
+        return(0);
+    }
+    madvise(pui8Map, ui32Length, MADV_WILLNEED);
+    if(mlock(pui8Map, ui32Length) < 0)
+    {
+        msg_pdbg("Image not locked in memory: %s\n", strerror(errno));
+    }
+    return(pui8Map);
+}
+
+//*****************************************************************************
+//
+//! OpenPacketFile() maps hFile if it is a packet file.
+//!
+//! \param psPacketFile receives the mapping.
+//! \param hFile is the file given to program.
+//! \param ui32FileSize is the size of hFile.
+//!
+//! The header and every range of the file are checked against its size, so
+//! the frames can be used without further checks. On success the mapping is
+//! kept in psPacketFile until UnloadTransfer().
+//!
+//! \return This function returns 1 if hFile is a packet file, 0 if it is a
+//!     plain image and a negative value if it is a broken packet file.
+//
+//*****************************************************************************
+static int32_t
+OpenPacketFile(tPacketFile *psPacketFile, FILE *hFile, uint32_t ui32FileSize)
+{
+    tPacketFileHeader sHeader;
+    const tPacketFileWindow *psWindow;
+    uint64_t ui64End;
+    uint32_t i;
+
+    if(ui32FileSize < sizeof(sHeader.pcMagic) ||
+       pread(fileno(hFile), &sHeader, sizeof(sHeader.pcMagic), 0) != sizeof(sHeader.pcMagic))
+    {
+        return(0);
+    }
+    if(!memcmp(sHeader.pcMagic, PACKET_FILE_MAGIC_1, sizeof(sHeader.pcMagic)))
+    {
+        msg_pinfo("Packet file of an older version, prepare it again.\n");
+        return(-1);
+    }
+    if(ui32FileSize < sizeof(sHeader) ||
+       pread(fileno(hFile), &sHeader, sizeof(sHeader), 0) != sizeof(sHeader) ||
+       memcmp(sHeader.pcMagic, PACKET_FILE_MAGIC, sizeof(sHeader.pcMagic)))
+    {
+        return(0);
+    }
+
+    if(sHeader.ui32BlockSize == 0 ||
+       sHeader.ui32BlockSize > MAX_BLOCK_TRANSFER_SIZE ||
+       sHeader.ui32ImageLength == 0 ||
+       sizeof(sHeader) + (uint64_t)sHeader.ui32Windows * sizeof(tPacketFileWindow) >
+           sHeader.ui32ImageOffset ||
+       (uint64_t)sHeader.ui32ImageOffset + sHeader.ui32ImageLength > ui32FileSize ||
+       sHeader.ui32Windows > sHeader.ui32ImageLength / FLASH_PAGE_SIZE + 2)
+    {
+        msg_pinfo("Broken packet file header.\n");
+        return(-1);
+    }
+
+    psPacketFile->pui8Map = MapFile(hFile, ui32FileSize);
+    if(psPacketFile->pui8Map == 0)
+    {
+        msg_pinfo("Cannot map the packet file: %s\n", strerror(errno));
+        return(-1);
+    }
+    psPacketFile->ui32MapLength = ui32FileSize;
+    psPacketFile->sHeader = sHeader;
+
+    psWindow = (const tPacketFileWindow *)&psPacketFile->pui8Map[sizeof(sHeader)];
+    for(i = 0; i < sHeader.ui32Windows; i++, psWindow++)
+    {
+        ui64End = psWindow->ui32FrameOffset +
+                  (uint64_t)(psWindow->ui32Length + sHeader.ui32BlockSize - 1) /
+                  sHeader.ui32BlockSize * (sHeader.ui32BlockSize + 3);
+        if((uint64_t)psWindow->ui32Start + psWindow->ui32Length > sHeader.ui32ImageLength ||
+           (psWindow->ui32Program && (psWindow->ui32FrameOffset == 0 ||
+                                      ui64End > ui32FileSize)))
+        {
+            msg_pinfo("Broken packet file range %u.\n", i);
+            munmap(psPacketFile->pui8Map, ui32FileSize);
+            psPacketFile->pui8Map = 0;
+            return(-1);
+        }
+    }
+    return(1);
+}
+
+//*****************************************************************************
+//
+//! LoadTransfer() makes the whole transfer available in memory.
+//!
+//! \param psPacketFile is the packet file hFile was opened as, if any.
+//! \param hFile is the application file.
+//! \param hBootFile is the boot loader file or 0.
+//! \param ui32BootFileLength is the size of the boot loader file.
+//! \param ui32Address is where the application starts in the transfer when
+//!     a boot loader is prepended.
+//! \param ui32TransferLength is the length of the transfer.
+//! \param pbMapped is set if the returned buffer is a mapping of hFile.
+//!
+//! A plain application file is mapped read-only and the packets are built
+//! straight from the mapping. A boot loader and application pair, or a file
+//! that cannot be mapped, is read into one buffer instead. The image of a
+//! packet file opened by OpenPacketFile() is already mapped.
+//!
+//! \return This function returns the transfer, or NULL on failure. Release it
+//!     with UnloadTransfer().
+//
+//*****************************************************************************
+static uint8_t *
+LoadTransfer(const tPacketFile *psPacketFile, FILE *hFile, FILE *hBootFile,
+             uint32_t ui32BootFileLength, uint32_t ui32Address,
+             uint32_t ui32TransferLength, bool *pbMapped)
+{
+    uint8_t *pui8Image;
+
+    *pbMapped = false;
+    if(psPacketFile->pui8Map)
+    {
+        *pbMapped = true;
+        return(&psPacketFile->pui8Map[psPacketFile->sHeader.ui32ImageOffset]);
+    }
+    if(hBootFile == 0)
+    {
+        pui8Image = MapFile(hFile, ui32TransferLength);
+        if(pui8Image)
+        {
+            *pbMapped = true;
+            return(pui8Image);
+        }
+    }
+
+    pui8Image = malloc(ui32TransferLength);
+    if(pui8Image == 0)
+    {
+        msg_pinfo("No Memory to allocate Buffer.\n");
+        return(0);
+    }
+    if(hBootFile)
+    {
+        fseek(hBootFile, 0, SEEK_SET);
+        if(fread(pui8Image, sizeof(uint8_t), ui32BootFileLength, hBootFile) !=
+            ui32BootFileLength)
+        {
+            free(pui8Image);
+            return(0);
+        }
+
+        //
+        // Pad the unused code space with 0xff to have all of the flash in
+        // a known state.
+        //
+        memset(&pui8Image[ui32BootFileLength], 0xff,
+            ui32Address - ui32BootFileLength);
+
+        //
+        // Append the application to the boot loader image.
+        //
+        ui32TransferLength -= ui32Address;
+        pui8Image += ui32Address;
+    }
+    fseek(hFile, 0, SEEK_SET);
+    if(fread(pui8Image, sizeof(uint8_t), ui32TransferLength, hFile) !=
+        ui32TransferLength)
+    {
+        free(hBootFile ? pui8Image - ui32Address : pui8Image);
+        return(0);
+    }
+    return(hBootFile ? pui8Image - ui32Address : pui8Image);
+}
+
+static void
+UnloadTransfer(tPacketFile *psPacketFile, uint8_t *pui8Image,
+               uint32_t ui32TransferLength, bool bMapped)
+{
+    if(psPacketFile->pui8Map)
+    {
+        munmap(psPacketFile->pui8Map, psPacketFile->ui32MapLength);
+        psPacketFile->pui8Map = 0;
+    }
+    else if(bMapped)
+    {
+        munmap(pui8Image, ui32TransferLength);
+    }
+    else
+    {
+        free(pui8Image);
+    }
+}
+
+//*****************************************************************************
+//
+//! CheckImageVersion() tells whether an image file carries a version text.
+//!
+//! \param hFile is the application file or a packet file.
+//! \param pcVersion is the text ReadVersion() got from the running firmware.
+//! \param i32Length is the length of the text.
+//!
+//! The image is mapped as for an update and searched as MatchVersion()
+//! describes. Only the image inside a packet file is searched, not its
+//! frames.
+//!
+//! \return This function returns 1 if the image carries the text and 0 if
+//!     it does not or cannot be read.
+//
+//*****************************************************************************
+int32_t
+CheckImageVersion(FILE *hFile, const char *pcVersion, int32_t i32Length)
+{
+    tPacketFile sPacketFile;
+    struct stat sStat;
+    uint8_t *pui8Image;
+    uint32_t ui32Length;
+    int32_t i32Ret;
+    bool bMapped;
+
+    if(fstat(fileno(hFile), &sStat) < 0 || sStat.st_size <= 0 ||
+       sStat.st_size > UINT32_MAX)
+    {
+        return(0);
+    }
+    memset(&sPacketFile, 0, sizeof(sPacketFile));
+    i32Ret = OpenPacketFile(&sPacketFile, hFile, sStat.st_size);
+    if(i32Ret < 0)
+    {
+        return(0);
+    }
+    ui32Length = i32Ret ? sPacketFile.sHeader.ui32ImageLength : sStat.st_size;
+    pui8Image = LoadTransfer(&sPacketFile, hFile, 0, 0, 0, ui32Length, &bMapped);
+    if(pui8Image == 0)
+    {
+        UnloadTransfer(&sPacketFile, 0, 0, false);
+        return(0);
+    }
+    i32Ret = MatchVersion(pui8Image, ui32Length, pcVersion, i32Length);
+    UnloadTransfer(&sPacketFile, pui8Image, ui32Length, bMapped);
+    return(i32Ret);
+}
+
+//*****************************************************************************
+//
+//! PlanTransfer() finds the parts of the transfer that need programming.
+//!
+//! \param psWindows receives the ranges to erase, and to program where
+//!     bProgram is set, as offsets into the transfer.
+//! \param pui8Image is the transfer.
+//! \param hBaseFile is the image the flash holds now, or 0 if unknown.
+//! \param ui32TransferStart is the flash address of the transfer.
+//! \param ui32TransferLength is the length of the transfer.
+//!
+//! Flash pages whose bytes match the base image are left alone. Pages that
+//! are entirely 0xff only need the erase, so their data is not sent. The
+//! rest are erased and programmed. Neighbouring pages that are treated alike
+//! are merged into one range. psWindows must have room for one range per
+//! page, plus one.
+//!
+//! \return This function returns the number of ranges.
+//
+//*****************************************************************************
+static int32_t
+PlanTransfer(tTransferWindow *psWindows, const uint8_t *pui8Image, FILE *hBaseFile,
+             uint32_t ui32TransferStart, uint32_t ui32TransferLength)
+{
+    uint8_t pui8Base[FLASH_PAGE_SIZE];
+    const uint8_t *pui8Page;
+    uint32_t ui32Offset, ui32PageLength, i;
+    int32_t i32BaseLength, i32Windows = 0;
+    bool bProgram;
+
+    for(ui32Offset = 0; ui32Offset < ui32TransferLength; ui32Offset += ui32PageLength)
+    {
+        //
+        // Look at one flash page, or what of it lies within the transfer.
+        //
+        ui32PageLength = FLASH_PAGE_SIZE -
+                         (ui32TransferStart + ui32Offset) % FLASH_PAGE_SIZE;
+        if(ui32PageLength > ui32TransferLength - ui32Offset)
+        {
+            ui32PageLength = ui32TransferLength - ui32Offset;
+        }
+        pui8Page = &pui8Image[ui32Offset];
+        if(hBaseFile)
+        {
+            //
+            // Read at the offset, as processes forked for other buses may
+            // share the file and its position with this one.
+            //
+            i32BaseLength = pread(fileno(hBaseFile), pui8Base, ui32PageLength, ui32Offset);
+            if(i32BaseLength == (int32_t)ui32PageLength &&
+               !memcmp(pui8Page, pui8Base, ui32PageLength))
+            {
+                continue;
+            }
+        }
+
+        //
+        // Erased flash reads 0xff already.
+        //
+        bProgram = false;
+        for(i = 0; i < ui32PageLength; i++)
+        {
+            if(pui8Page[i] != 0xff)
+            {
+                bProgram = true;
+                break;
+            }
+        }
+
+        if(i32Windows &&
+           psWindows[i32Windows - 1].bProgram == bProgram &&
+           psWindows[i32Windows - 1].ui32Start + psWindows[i32Windows - 1].ui32Length == ui32Offset)
+        {
+            psWindows[i32Windows - 1].ui32Length += ui32PageLength;
+        }
+        else
+        {
+            psWindows[i32Windows].ui32Start = ui32Offset;
+            psWindows[i32Windows].ui32Length = ui32PageLength;
+            psWindows[i32Windows].bProgram = bProgram;
+            psWindows[i32Windows].pui8Frames = 0;
+            i32Windows++;
+        }
+    }
+    return(i32Windows);
+}
+
+//*****************************************************************************
+//
+//! BuildDataFrame() frames one COMMAND_SEND_DATA packet.
+//!
+//! \param pui8Frame receives the size byte, the checksum and the packet, at
+//!     most MAX_BLOCK_TRANSFER_SIZE + 3 bytes.
+//! \param pui8Block is the image data to program.
+//! \param ui8Size is the number of bytes in pui8Block.
+//
+//*****************************************************************************
+static void
+BuildDataFrame(uint8_t *pui8Frame, const uint8_t *pui8Block, uint8_t ui8Size)
+{
+    pui8Frame[0] = ui8Size + 3;
+    pui8Frame[2] = COMMAND_SEND_DATA;
+    memcpy(&pui8Frame[3], pui8Block, ui8Size);
+    pui8Frame[1] = CheckSum(&pui8Frame[2], ui8Size + 1);
+}
+
+//*****************************************************************************
+//
+//! TransferFrame() gives the frame of the data block at an offset of the
+//! transfer.
+//!
+//! \param psCtx is the update context.
+//! \param psWindow is the range being programmed.
+//! \param pui8Image is the transfer.
+//! \param ui32Offset is the offset of the block in the transfer.
+//! \param ui32Size is the size of the block.
+//! \param pui8Buffer has room for a frame of the block.
+//!
+//! If the range comes with prepared frames and the block is one of them,
+//! the frame is taken as it is. Otherwise the block is framed into
+//! pui8Buffer, which also covers the short block that realigns to the frames
+//! after a rewind. The block counts as sent from here.
+//!
+//! \return This function returns the frame.
+//
+//*****************************************************************************
+static const uint8_t *
+TransferFrame(struct bmc_context *psCtx, const tTransferWindow *psWindow,
+              const uint8_t *pui8Image, uint32_t ui32Offset, uint32_t ui32Size,
+              uint8_t *pui8Buffer)
+{
+    uint32_t ui32Block = (ui32Offset - psWindow->ui32Start) / psCtx->block_size;
+
+    psCtx->stats.data_packets++;
+    psCtx->stats.payload_bytes += ui32Size;
+    if(psWindow->pui8Frames &&
+       (ui32Offset - psWindow->ui32Start) % psCtx->block_size == 0)
+    {
+        return(&psWindow->pui8Frames[ui32Block * (psCtx->block_size + 3)]);
+    }
+    BuildDataFrame(pui8Buffer, &pui8Image[ui32Offset], ui32Size);
+    return(pui8Buffer);
+}
+
+//*****************************************************************************
+//
+//! NextBlock() returns the size of the data block to send at an offset.
+//!
+//! \param psCtx is the update context.
+//! \param psWindow is the range being programmed.
+//! \param ui32Offset is the offset of the block in the transfer.
+//!
+//! Blocks follow the block grid of the range, so after a rewind the first
+//! block is shortened to get back onto it.
+//
+//*****************************************************************************
+static uint32_t
+NextBlock(struct bmc_context *psCtx, const tTransferWindow *psWindow, uint32_t ui32Offset)
+{
+    uint32_t ui32Chunk;
+
+    ui32Chunk = psCtx->block_size - (ui32Offset - psWindow->ui32Start) % psCtx->block_size;
+    if(ui32Chunk > psWindow->ui32Start + psWindow->ui32Length - ui32Offset)
+    {
+        ui32Chunk = psWindow->ui32Start + psWindow->ui32Length - ui32Offset;
+    }
+    return(ui32Chunk);
+}
+
+//*****************************************************************************
+//
+//! RewindOffset() returns where to restart a range after a failed block.
+//!
+//! \param ui32TransferStart is the flash address of the transfer.
+//! \param psWindow is the range being programmed.
+//! \param ui32Confirmed is the offset the boot loader last reported good.
+//!
+//! The boot loader cannot move its write pointer back, so the range is
+//! erased again from the flash page holding the last confirmed byte and
+//! everything after that is resent.
+//
+//*****************************************************************************
+static uint32_t
+RewindOffset(uint32_t ui32TransferStart, const tTransferWindow *psWindow,
+             uint32_t ui32Confirmed)
+{
+    uint32_t ui32Offset;
+
+    ui32Offset = (ui32TransferStart + ui32Confirmed) & ~(FLASH_PAGE_SIZE - 1);
+    ui32Offset = ui32Offset < ui32TransferStart ? 0 : ui32Offset - ui32TransferStart;
+    if(ui32Offset < psWindow->ui32Start)
+    {
+        ui32Offset = psWindow->ui32Start;
+    }
+    return(ui32Offset);
+}
+
+//*****************************************************************************
+//
+// The SHA-256 round constants, FIPS 180-4.
+//
+//*****************************************************************************
+static const uint32_t g_pui32Sha256K[64] =
+{
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4,
+    0xab1c5ed5, 0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe,
+    0x9bdc06a7, 0xc19bf174, 0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f,
+    0x4a7484aa, 0x5cb0a9dc, 0x76f988da, 0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7,
+    0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967, 0x27b70a85, 0x2e1b2138, 0x4d2c6dfc,
+    0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85, 0xa2bfe8a1, 0xa81a664b,
+    0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070, 0x19a4c116,
+    0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7,
+    0xc67178f2
+};
+
+#define ROTR32(x, n)        (((x) >> (n)) | ((x) << (32 - (n))))
+
+//*****************************************************************************
+//
+//! Sha256Block() runs the SHA-256 compression on one 64 byte block.
+//!
+//! \param pui32State is the hash state, updated in place.
+//! \param pui8Block is the block.
+//
+//*****************************************************************************
+static void
+Sha256Block(uint32_t *pui32State, const uint8_t *pui8Block)
+{
+    uint32_t pui32W[64];
+    uint32_t pui32V[8];
+    uint32_t ui32T1, ui32T2;
+    int32_t i;
+
+    for(i = 0; i < 16; i++)
+    {
+        pui32W[i] = (uint32_t)pui8Block[i * 4] << 24 | (uint32_t)pui8Block[i * 4 + 1] << 16 |
+                    (uint32_t)pui8Block[i * 4 + 2] << 8 | pui8Block[i * 4 + 3];
+    }
+    for(i = 16; i < 64; i++)
+    {
+        pui32W[i] = pui32W[i - 16] + pui32W[i - 7] +
+                    (ROTR32(pui32W[i - 15], 7) ^ ROTR32(pui32W[i - 15], 18) ^
+                     (pui32W[i - 15] >> 3)) +
+                    (ROTR32(pui32W[i - 2], 17) ^ ROTR32(pui32W[i - 2], 19) ^
+                     (pui32W[i - 2] >> 10));
+    }
+    memcpy(pui32V, pui32State, sizeof(pui32V));
+    for(i = 0; i < 64; i++)
+    {
+        ui32T1 = pui32V[7] + (ROTR32(pui32V[4], 6) ^ ROTR32(pui32V[4], 11) ^
+                              ROTR32(pui32V[4], 25)) +
+                 ((pui32V[4] & pui32V[5]) ^ (~pui32V[4] & pui32V[6])) +
+                 g_pui32Sha256K[i] + pui32W[i];
+        ui32T2 = (ROTR32(pui32V[0], 2) ^ ROTR32(pui32V[0], 13) ^ ROTR32(pui32V[0], 22)) +
+                 ((pui32V[0] & pui32V[1]) ^ (pui32V[0] & pui32V[2]) ^
+                  (pui32V[1] & pui32V[2]));
+        memmove(&pui32V[1], &pui32V[0], sizeof(pui32V[0]) * 7);
+        pui32V[4] += ui32T1;
+        pui32V[0] = ui32T1 + ui32T2;
+    }
+    for(i = 0; i < 8; i++)
+    {
+        pui32State[i] += pui32V[i];
+    }
+}
+
+//*****************************************************************************
+//
+//! ImageDigest() computes the SHA-256 digest of an image.
+//!
+//! \param pui8Image is the image.
+//! \param ui32Length is the size of the image.
+//! \param pui8Digest receives the 32 byte digest.
+//
+//*****************************************************************************
+static void
+ImageDigest(const uint8_t *pui8Image, uint32_t ui32Length, uint8_t *pui8Digest)
+{
+    uint32_t pui32State[8] =
+    {
+        0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+        0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+    };
+    uint8_t pui8Block[64];
+    uint64_t ui64Bits = (uint64_t)ui32Length * 8;
+    uint32_t i, ui32Rest;
+
+    for(i = 0; ui32Length - i >= sizeof(pui8Block); i += sizeof(pui8Block))
+    {
+        Sha256Block(pui32State, &pui8Image[i]);
+    }
+
+    //
+    // Pad the rest with a 1 bit, zeros and the length in bits.
+    //
+    ui32Rest = ui32Length - i;
+    memset(pui8Block, 0, sizeof(pui8Block));
+    memcpy(pui8Block, &pui8Image[i], ui32Rest);
+    pui8Block[ui32Rest] = 0x80;
+    if(ui32Rest >= sizeof(pui8Block) - 8)
+    {
+        Sha256Block(pui32State, pui8Block);
+        memset(pui8Block, 0, sizeof(pui8Block));
+    }
+    for(i = 0; i < 8; i++)
+    {
+        pui8Block[sizeof(pui8Block) - 1 - i] = ui64Bits >> (i * 8);
+    }
+    Sha256Block(pui32State, pui8Block);
+
+    for(i = 0; i < 32; i++)
+    {
+        pui8Digest[i] = pui32State[i / 4] >> (24 - (i % 4) * 8);
+    }
+}
+
+//*****************************************************************************
+//
+//! PrepareImage() writes a packet file for an image.
+//!
+//! \param hFile is the image.
+//! \param hOut is the packet file to write.
+//! \param ui32Address is the flash address the image will be programmed to.
+//! \param ui32BlockSize is the data block size of the frames.
+//!
+//! The image is planned as an update would without a base image, and every
+//! SEND_DATA packet of the ranges to program is framed in advance. An update
+//! given the packet file sends these frames as they are and uses blocks of
+//! that size.
+//!
+//! \return This function returns zero on success and a negative value on
+//!     failure.
+//
+//*****************************************************************************
+int32_t
+PrepareImage(FILE *hFile, FILE *hOut, uint32_t ui32Address, uint32_t ui32BlockSize)
+{
+    tPacketFile sPacketFile;
+    tPacketFileHeader sHeader;
+    tPacketFileWindow sWindow;
+    tTransferWindow *psWindows;
+    uint8_t pui8Frame[MAX_BLOCK_TRANSFER_SIZE + 3];
+    uint8_t *pui8Image;
+    uint32_t ui32Offset, ui32Chunk, ui32FrameOffset;
+    int32_t i32Windows, i32Window;
+    int32_t i32Ret = 0;
+    bool bMapped;
+    struct stat sStat;
+
+    if(ui32BlockSize == 0 || ui32BlockSize > MAX_BLOCK_TRANSFER_SIZE)
+    {
+        return(-1);
+    }
+    if(fstat(fileno(hFile), &sStat) < 0 || sStat.st_size <= 0 ||
+       sStat.st_size > UINT32_MAX)
+    {
+        msg_pinfo("Cannot tell the size of the image, or it is empty.\n");
+        return(-1);
+    }
+    memset(&sPacketFile, 0, sizeof(sPacketFile));
+    if(OpenPacketFile(&sPacketFile, hFile, sStat.st_size) != 0)
+    {
+        msg_pinfo("The image is a packet file already.\n");
+        UnloadTransfer(&sPacketFile, 0, 0, false);
+        return(-1);
+    }
+
+    pui8Image = LoadTransfer(&sPacketFile, hFile, 0, 0, 0, sStat.st_size, &bMapped);
+    psWindows = malloc(sizeof(tTransferWindow) *
+                       (sStat.st_size / FLASH_PAGE_SIZE + 2));
+    if(pui8Image == 0 || psWindows == 0)
+    {
+        msg_pinfo("Failed to read the image\n");
+        if(pui8Image)
+        {
+            UnloadTransfer(&sPacketFile, pui8Image, sStat.st_size, bMapped);
+        }
+        free(psWindows);
+        return(-1);
+    }
+    i32Windows = PlanTransfer(psWindows, pui8Image, 0, ui32Address, sStat.st_size);
+
+    memset(&sHeader, 0, sizeof(sHeader));
+    memcpy(sHeader.pcMagic, PACKET_FILE_MAGIC, sizeof(sHeader.pcMagic));
+    sHeader.ui32BlockSize = ui32BlockSize;
+    sHeader.ui32Address = ui32Address;
+    sHeader.ui32ImageLength = sStat.st_size;
+    sHeader.ui32ImageOffset = sizeof(sHeader) + i32Windows * sizeof(sWindow);
+    sHeader.ui32Windows = i32Windows;
+    ImageDigest(pui8Image, sHeader.ui32ImageLength, sHeader.pui8Digest);
+    if(fwrite(&sHeader, sizeof(sHeader), 1, hOut) != 1)
+    {
+        i32Ret = -1;
+    }
+
+    //
+    // The frames follow the image, each range's frames back to back in
+    // slots of the full frame size.
+    //
+    ui32FrameOffset = sHeader.ui32ImageOffset + sHeader.ui32ImageLength;
+    for(i32Window = 0; i32Ret == 0 && i32Window < i32Windows; i32Window++)
+    {
+        sWindow.ui32Start = psWindows[i32Window].ui32Start;
+        sWindow.ui32Length = psWindows[i32Window].ui32Length;
+        sWindow.ui32Program = psWindows[i32Window].bProgram;
+        sWindow.ui32FrameOffset = 0;
+        if(sWindow.ui32Program)
+        {
+            sWindow.ui32FrameOffset = ui32FrameOffset;
+            ui32FrameOffset += (sWindow.ui32Length + ui32BlockSize - 1) /
+                               ui32BlockSize * (ui32BlockSize + 3);
+        }
+        if(fwrite(&sWindow, sizeof(sWindow), 1, hOut) != 1)
+        {
+            i32Ret = -1;
+        }
+    }
+    if(i32Ret == 0 &&
+       fwrite(pui8Image, 1, sHeader.ui32ImageLength, hOut) != sHeader.ui32ImageLength)
+    {
+        i32Ret = -1;
+    }
+
+    for(i32Window = 0; i32Ret == 0 && i32Window < i32Windows; i32Window++)
+    {
+        if(!psWindows[i32Window].bProgram)
+        {
+            continue;
+        }
+        ui32Offset = psWindows[i32Window].ui32Start;
+        while(i32Ret == 0 &&
+              ui32Offset < psWindows[i32Window].ui32Start + psWindows[i32Window].ui32Length)
+        {
+            ui32Chunk = psWindows[i32Window].ui32Start +
+                        psWindows[i32Window].ui32Length - ui32Offset;
+            if(ui32Chunk > ui32BlockSize)
+            {
+                ui32Chunk = ui32BlockSize;
+            }
+            memset(pui8Frame, 0, sizeof(pui8Frame));
+            BuildDataFrame(pui8Frame, &pui8Image[ui32Offset], ui32Chunk);
+            if(fwrite(pui8Frame, 1, ui32BlockSize + 3, hOut) != ui32BlockSize + 3)
+            {
+                i32Ret = -1;
+            }
+            ui32Offset += ui32Chunk;
+        }
+    }
+
+    if(i32Ret == 0)
+    {
+        msg_pinfo("Prepared %d ranges of %u byte blocks for address 0x%08x.\n",
+                  i32Windows, ui32BlockSize, ui32Address);
+    }
+    else
+    {
+        msg_pinfo("Failed to write the packet file: %s\n", strerror(errno));
+    }
+    free(psWindows);
+    UnloadTransfer(&sPacketFile, pui8Image, sStat.st_size, bMapped);
+    return(i32Ret);
+}
+
+//*****************************************************************************
+//
+//! OpenCachedImage() maps the shared packet file of an image.
+//!
+//! \param psCtx is the update context, whose image_cache names the directory.
+//! \param psPacketFile receives the mapping.
+//! \param hFile is the plain application file.
+//! \param ui32FileLength is the size of hFile.
+//! \param ui32Address is the flash address of the application.
+//! \param ui32BlockSize is the data block size to frame for.
+//!
+//! The packet file is named after the SHA-256 digest of the image, the
+//! address and the block size. The first update of an image writes it with
+//! PrepareImage() and renames it into place, so the image is checked and
+//! framed once. Every later update, from this process or another, maps the
+//! same file read-only and shares its pages in the page cache. A file found
+//! there is used if its header carries the digest, address, length and block
+//! size of this update; its frames are trusted as they are, so the cache
+//! directory must be writable only by those who may flash the BMCs. A file
+//! that does not match is written again.
+//!
+//! \return This function returns 1 if psPacketFile maps the shared packet
+//!     file, and 0 if the update has to load hFile itself.
+//
+//*****************************************************************************
+static int32_t
+OpenCachedImage(struct bmc_context *psCtx, tPacketFile *psPacketFile, FILE *hFile,
+                uint32_t ui32FileLength, uint32_t ui32Address, uint32_t ui32BlockSize)
+{
+    char pcPath[4096], pcTemp[4096 + 8], pcDigest[65];
+    struct stat sStat;
+    uint8_t *pui8Image;
+    uint8_t pui8Digest[32];
+    FILE *hCache;
+    int32_t i32Try, i32Ret, i32Found = 0, i;
+    int iFd, iLock = -1;
+
+    pui8Image = mmap(NULL, ui32FileLength, PROT_READ, MAP_PRIVATE, fileno(hFile), 0);
+    if(pui8Image == MAP_FAILED)
+    {
+        return(0);
+    }
+    ImageDigest(pui8Image, ui32FileLength, pui8Digest);
+    munmap(pui8Image, ui32FileLength);
+    for(i = 0; i < 32; i++)
+    {
+        sprintf(&pcDigest[i * 2], "%02x", pui8Digest[i]);
+    }
+    snprintf(pcPath, sizeof(pcPath), "%s/%s-%08x-%u.bmcpkt", psCtx->image_cache,
+             pcDigest, ui32Address, ui32BlockSize);
+
+    for(i32Try = 0; i32Try < 3; i32Try++)
+    {
+        hCache = fopen(pcPath, "rb");
+        if(hCache)
+        {
+            if(fstat(fileno(hCache), &sStat) == 0 && sStat.st_size <= UINT32_MAX &&
+               OpenPacketFile(psPacketFile, hCache, sStat.st_size) == 1)
+            {
+                if(psPacketFile->sHeader.ui32Address == ui32Address &&
+                   psPacketFile->sHeader.ui32BlockSize == ui32BlockSize &&
+                   psPacketFile->sHeader.ui32ImageLength == ui32FileLength &&
+                   !memcmp(psPacketFile->sHeader.pui8Digest, pui8Digest, sizeof(pui8Digest)))
+                {
+                    i32Found = 1;
+                }
+                else
+                {
+                    UnloadTransfer(psPacketFile, 0, 0, false);
+                }
+            }
+            fclose(hCache);
+            if(i32Found)
+            {
+                break;
+            }
+        }
+        if(i32Try == 0)
+        {
+            //
+            // Look again holding the lock of the cache, an update that got
+            // there first may just be framing the same image.
+            //
+            mkdir(psCtx->image_cache, 0700);
+            snprintf(pcTemp, sizeof(pcTemp), "%s/.lock", psCtx->image_cache);
+            iLock = open(pcTemp, O_RDWR | O_CREAT, 0600);
+            if(iLock >= 0)
+            {
+                flock(iLock, LOCK_EX);
+            }
+            continue;
+        }
+        if(i32Try == 2)
+        {
+            break;
+        }
+
+        //
+        // Frame the image into a file of its own first, so no update ever
+        // maps a file that is still being written.
+        //
+        snprintf(pcTemp, sizeof(pcTemp), "%s.XXXXXX", pcPath);
+        iFd = mkstemp(pcTemp);
+        if(iFd < 0 || (hCache = fdopen(iFd, "wb")) == 0)
+        {
+            msg_pdbg("Cannot write to the image cache %s: %s\n", psCtx->image_cache,
+                     strerror(errno));
+            if(iFd >= 0)
+            {
+                close(iFd);
+                unlink(pcTemp);
+            }
+            break;
+        }
+        i32Ret = PrepareImage(hFile, hCache, ui32Address, ui32BlockSize);
+        if(fclose(hCache) || i32Ret < 0 || rename(pcTemp, pcPath) < 0)
+        {
+            unlink(pcTemp);
+            break;
+        }
+    }
+    if(iLock >= 0)
+    {
+        close(iLock);
+    }
+    if(i32Found)
+    {
+        msg_pdbg("Sending the frames of %s.\n", pcPath);
+    }
+    return(i32Found);
+}
+
+//*****************************************************************************
+//
+//! LoadUpdate() gets everything ready that the transfer needs from the host.
+//!
+//! \param psCtx is the update context.
+//! \param psUpdate receives the loaded update.
+//! \param hFile is the application file or a packet file.
+//! \param hBootFile is the boot loader file or 0.
+//! \param ui32Address is the flash address of the application.
+//! \param ui32FrameBlock is the block size to frame the data for, or 0 to
+//!     frame each block while it is sent.
+//!
+//! The files are checked and loaded, the transfer is planned and, if asked
+//! for, all SEND_DATA frames are built. None of this touches the bus, so it
+//! can run while the device is busy. Release the update with UnloadUpdate().
+//!
+//! \return This function returns zero on success and a negative value on
+//!     failure. psUpdate->i32Result holds the same value.
+//
+//*****************************************************************************
+static int32_t
+LoadUpdate(struct bmc_context *psCtx, tUpdate *psUpdate, FILE *hFile,
+           FILE *hBootFile, uint32_t ui32Address, uint32_t ui32FrameBlock)
+{
+    uint32_t ui32FileLength;
+    uint32_t ui32BootFileLength = 0;
+    uint32_t ui32Frames, ui32Offset, ui32Chunk;
+    uint8_t *pui8Frame;
+    int32_t i32Packets, i32Window;
+    tTransferWindow *psWindow;
+    const tPacketFileWindow *psPacketWindow;
+    struct stat sStat;
+
+    memset(psUpdate, 0, sizeof(*psUpdate));
+    psUpdate->hFile = hFile;
+    psUpdate->hBootFile = hBootFile;
+    psUpdate->ui32Address = ui32Address;
+    psUpdate->i32Result = -1;
+
+    //
+    // At least one file must be specified.
+    //
+    if(hFile == 0)
+    {
+        return(-1);
+    }
+
+    //
+    // Get the file sizes.
+    //
+    if(fstat(fileno(hFile), &sStat) < 0 || sStat.st_size <= 0 ||
+       sStat.st_size > UINT32_MAX)
+    {
+        msg_pinfo("Cannot tell the size of the image, or it is empty.\n");
+        return(-1);
+    }
+    ui32FileLength = sStat.st_size;
+
+    //
+    // A packet file carries the image after its header and frames.
+    //
+    i32Packets = OpenPacketFile(&psUpdate->sPacketFile, hFile, sStat.st_size);
+    if(i32Packets < 0)
+    {
+        return(-1);
+    }
+    if(i32Packets)
+    {
+        ui32FileLength = psUpdate->sPacketFile.sHeader.ui32ImageLength;
+        if(hBootFile)
+        {
+            msg_pinfo("A packet file cannot be programmed with a boot loader.\n");
+            UnloadTransfer(&psUpdate->sPacketFile, 0, 0, false);
+            return(-1);
+        }
+    }
+    /*
+    if((g_pcFilename == g_pcBootLoadName) && ui32FileLength > 0x2000)
+    {
+        msg_pinfo("Bootloader file is too big\n");
+        return(-1);
+    }
+    */
+
+    //
+    // A plain image may have been framed for this block size before, by
+    // this or another update.
+    //
+    if(i32Packets == 0 && hBootFile == 0 && psCtx->image_cache && psCtx->base_file == 0 &&
+       (ui32FrameBlock || psCtx->block_size))
+    {
+        i32Packets = OpenCachedImage(psCtx, &psUpdate->sPacketFile, hFile, ui32FileLength,
+                                     ui32Address,
+                                     ui32FrameBlock ? ui32FrameBlock : psCtx->block_size);
+    }
+
+    //
+    // Default the transfer length to be the size of the application.
+    //
+    psUpdate->ui32TransferLength = ui32FileLength;
+    psUpdate->ui32TransferStart = ui32Address;
+
+    if(hBootFile)
+    {
+        if(fstat(fileno(hBootFile), &sStat) < 0)
+        {
+            return(-1);
+        }
+        ui32BootFileLength = sStat.st_size;
 
-
-
-
-
-
-
-
+        if(ui32BootFileLength != 0x2000)
+        {
+            msg_pinfo("Wrong Bootloader file size (need exactly 8192 bytes).\n");
+            return(-1);
+        }
+
+        psUpdate->ui32TransferLength = ui32Address + ui32FileLength;
+        psUpdate->ui32TransferStart = 0;
+    }
+    else if(ui32FileLength == 0x2000 && ui32Address != 0x0000)
+    {
+        msg_pinfo("Bootloader file must be programmed with -l option.\n");
+        UnloadTransfer(&psUpdate->sPacketFile, 0, 0, false);
+        return(-1);
+    }
+
+    if(hBootFile && ui32Address < ui32BootFileLength)
+    {
+        return(-1);
+    }
+
+    psUpdate->ui32ImageLength = psUpdate->ui32TransferLength;
+    psUpdate->pui8Image = LoadTransfer(&psUpdate->sPacketFile, hFile, hBootFile, ui32BootFileLength,
+                                       ui32Address, psUpdate->ui32ImageLength,
+                                       &psUpdate->bMapped);
+    if(psUpdate->pui8Image == 0)
+    {
+        msg_pinfo("Failed to read the image\n");
+        return(-1);
+    }
+    psUpdate->psWindows = malloc(sizeof(tTransferWindow) *
+                                 (psUpdate->ui32TransferLength / FLASH_PAGE_SIZE + 2));
+    if(psUpdate->psWindows == 0)
+    {
+        msg_pinfo("No Memory to allocate Buffer.\n");
+        UnloadUpdate(psUpdate);
+        return(-1);
+    }
+
+    //
+    // Take the ranges and frames of a packet file if they were made for
+    // this address. A base image changes the ranges, so they are only used
+    // without one.
+    //
+    psUpdate->i32Windows = -1;
+    if(i32Packets && psCtx->base_file == 0 &&
+       psUpdate->sPacketFile.sHeader.ui32Address == ui32Address)
+    {
+        psPacketWindow = (const tPacketFileWindow *)
+                         &psUpdate->sPacketFile.pui8Map[sizeof(tPacketFileHeader)];
+        for(i32Window = 0; i32Window < (int32_t)psUpdate->sPacketFile.sHeader.ui32Windows;
+            i32Window++, psPacketWindow++)
+        {
+            psWindow = &psUpdate->psWindows[i32Window];
+            psWindow->ui32Start = psPacketWindow->ui32Start;
+            psWindow->ui32Length = psPacketWindow->ui32Length;
+            psWindow->bProgram = psPacketWindow->ui32Program != 0;
+            psWindow->pui8Frames = psWindow->bProgram ?
+                &psUpdate->sPacketFile.pui8Map[psPacketWindow->ui32FrameOffset] : 0;
+        }
+        psUpdate->i32Windows = i32Window;
+        psUpdate->ui32FrameBlock = psUpdate->sPacketFile.sHeader.ui32BlockSize;
+    }
+
+    //
+    // Otherwise work out which parts of the flash need to change. The base
+    // image only describes the application, so a boot loader update ignores
+    // it.
+    //
+    if(psUpdate->i32Windows < 0)
+    {
+        psUpdate->i32Windows = PlanTransfer(psUpdate->psWindows, psUpdate->pui8Image,
+                                            hBootFile ? 0 : psCtx->base_file,
+                                            psUpdate->ui32TransferStart,
+                                            psUpdate->ui32TransferLength);
+    }
+
+    //
+    // Frame the data of every range to program, each range's frames back to
+    // back in slots of the full frame size, as in a packet file.
+    //
+    if(psUpdate->ui32FrameBlock == 0 && ui32FrameBlock)
+    {
+        ui32Frames = 0;
+        for(i32Window = 0; i32Window < psUpdate->i32Windows; i32Window++)
+        {
+            if(psUpdate->psWindows[i32Window].bProgram)
+            {
+                ui32Frames += (psUpdate->psWindows[i32Window].ui32Length +
+                               ui32FrameBlock - 1) / ui32FrameBlock;
+            }
+        }
+        pui8Frame = malloc((size_t)ui32Frames * (ui32FrameBlock + 3) + 1);
+        if(pui8Frame == 0)
+        {
+            msg_pinfo("No Memory to allocate Buffer.\n");
+            UnloadUpdate(psUpdate);
+            return(-1);
+        }
+        psUpdate->pui8Frames = pui8Frame;
+        psUpdate->ui32FrameBlock = ui32FrameBlock;
+        psUpdate->ui32FramesLength = ui32Frames * (ui32FrameBlock + 3);
+        mlock(pui8Frame, psUpdate->ui32FramesLength);
+        for(i32Window = 0; i32Window < psUpdate->i32Windows; i32Window++)
+        {
+            psWindow = &psUpdate->psWindows[i32Window];
+            if(!psWindow->bProgram)
+            {
+                continue;
+            }
+            psWindow->pui8Frames = pui8Frame;
+            for(ui32Offset = psWindow->ui32Start;
+                ui32Offset < psWindow->ui32Start + psWindow->ui32Length;
+                ui32Offset += ui32Chunk)
+            {
+                ui32Chunk = psWindow->ui32Start + psWindow->ui32Length - ui32Offset;
+                if(ui32Chunk > ui32FrameBlock)
+                {
+                    ui32Chunk = ui32FrameBlock;
+                }
+                BuildDataFrame(pui8Frame, &psUpdate->pui8Image[ui32Offset], ui32Chunk);
+                pui8Frame += ui32FrameBlock + 3;
+            }
+        }
+    }
+
+    psUpdate->i32Result = 0;
+    return(0);
+}
+
+//*****************************************************************************
+//
+//! UnloadUpdate() releases what LoadUpdate() set up.
+//!
+//! \param psUpdate is the update.
+//
+//*****************************************************************************
+static void
+UnloadUpdate(tUpdate *psUpdate)
+{
+    if(psUpdate->pui8Image)
+    {
+        UnloadTransfer(&psUpdate->sPacketFile, psUpdate->pui8Image, psUpdate->ui32ImageLength,
+                       psUpdate->bMapped);
+    }
+    free(psUpdate->psWindows);
+    if(psUpdate->pui8Frames)
+    {
+        munlock(psUpdate->pui8Frames, psUpdate->ui32FramesLength);
+        free(psUpdate->pui8Frames);
+    }
+    psUpdate->pui8Image = 0;
+    psUpdate->psWindows = 0;
+    psUpdate->pui8Frames = 0;
+}
+
+static void *
+PreloadThread(void *pvArg)
+{
+    struct bmc_preload *psPreload = pvArg;
+    tUpdate *psUpdate = &psPreload->sUpdate;
+
+    LoadUpdate(psPreload->psCtx, psUpdate, psUpdate->hFile, psUpdate->hBootFile,
+               psUpdate->ui32Address, psUpdate->ui32FrameBlock);
+
+    //
+    // Wake up a StepUpdate() caller waiting for the update.
+    //
+    if(write(psPreload->piDone[1], "", 1) < 0)
+    {
+        msg_pdbg("Cannot signal the end of the preload.\n");
+    }
+    return(0);
+}
+
+//*****************************************************************************
+//
+//! PreloadUpdate() starts loading an update in the background.
+//!
+//! \param psCtx is the update context.
+//! \param hFile is the application file or a packet file.
+//! \param hBootFile is the boot loader file or 0.
+//! \param ui32Address is the flash address of the application.
+//!
+//! A worker thread runs LoadUpdate() and frames the data for the block size
+//! of psCtx, or for the largest block the transport could carry if that is
+//! still 0, while the caller waits for the device to enter its boot loader.
+//! StepUpdate() takes the result once the boot loader is up; otherwise it
+//! has to be dropped with CancelPreload(). A pipe becomes readable once the
+//! update is loaded, so an event loop can wait for it.
+//!
+//! \return This function returns zero if the worker was started. Otherwise
+//!     StepUpdate() loads the update itself.
+//
+//*****************************************************************************
+static int32_t
+PreloadUpdate(struct bmc_context *psCtx, FILE *hFile, FILE *hBootFile, uint32_t ui32Address)
+{
+    struct bmc_preload *psPreload;
+
+    if(psCtx->preload)
+    {
+        return(-1);
+    }
+    psPreload = calloc(1, sizeof(*psPreload));
+    if(psPreload == 0)
+    {
+        return(-1);
+    }
+    psPreload->psCtx = psCtx;
+    psPreload->sUpdate.hFile = hFile;
+    psPreload->sUpdate.hBootFile = hBootFile;
+    psPreload->sUpdate.ui32Address = ui32Address;
+    psPreload->sUpdate.ui32FrameBlock = psCtx->block_size ? psCtx->block_size :
+                                                            MaxBlockSize(psCtx);
+    if(pipe(psPreload->piDone) < 0)
+    {
+        free(psPreload);
+        return(-1);
+    }
+    if(pthread_create(&psPreload->hThread, NULL, PreloadThread, psPreload))
+    {
+        close(psPreload->piDone[0]);
+        close(psPreload->piDone[1]);
+        free(psPreload);
+        return(-1);
+    }
+    psCtx->preload = psPreload;
+    return(0);
+}
+
+//*****************************************************************************
+//
+//! TakePreload() waits for a PreloadUpdate() to finish.
+//!
+//! \param psCtx is the update context.
+//! \param psUpdate receives the update it loaded.
+//!
+//! \return This function returns true if there was a preload to take.
+//
+//*****************************************************************************
+static bool
+TakePreload(struct bmc_context *psCtx, tUpdate *psUpdate)
+{
+    struct bmc_preload *psPreload = psCtx->preload;
+
+    if(psPreload == 0)
+    {
+        return(false);
+    }
+    pthread_join(psPreload->hThread, NULL);
+    *psUpdate = psPreload->sUpdate;
+    psCtx->preload = 0;
+    close(psPreload->piDone[0]);
+    close(psPreload->piDone[1]);
+    free(psPreload);
+    return(true);
+}
+
+//*****************************************************************************
+//
+//! CancelPreload() waits for a PreloadUpdate() and drops its result.
+//!
+//! \param psCtx is the update context.
+//
+//*****************************************************************************
+static void
+CancelPreload(struct bmc_context *psCtx)
+{
+    tUpdate sUpdate;
+
+    if(TakePreload(psCtx, &sUpdate))
+    {
+        UnloadUpdate(&sUpdate);
+    }
+}
+
+//*****************************************************************************
+//
+//! GetUpdate() takes the update loaded in the background, or loads it now.
+//!
+//! \param psCtx is the update context.
+//! \param psUpdate receives the update.
+//! \param hFile is the application file or a packet file.
+//! \param hBootFile is the boot loader file or 0.
+//! \param ui32Address is the flash address of the application.
+//!
+//! \return This function returns zero on success and a negative value on
+//!     failure, after which psUpdate holds nothing.
+//
+//*****************************************************************************
+static int32_t
+GetUpdate(struct bmc_context *psCtx, tUpdate *psUpdate, FILE *hFile, FILE *hBootFile,
+          uint32_t ui32Address)
+{
+    if(TakePreload(psCtx, psUpdate))
+    {
+        if(psUpdate->hFile != hFile || psUpdate->hBootFile != hBootFile ||
+           psUpdate->ui32Address != ui32Address)
+        {
+            UnloadUpdate(psUpdate);
+            LoadUpdate(psCtx, psUpdate, hFile, hBootFile, ui32Address, 0);
+        }
+    }
+    else
+    {
+        LoadUpdate(psCtx, psUpdate, hFile, hBootFile, ui32Address, 0);
+    }
+    if(psUpdate->i32Result < 0)
+    {
+        UnloadUpdate(psUpdate);
+        return(-1);
+    }
+    return(0);
+}
+
+//*****************************************************************************
+//
+//! BeginTransfer() settles the frames of an update and reports its ranges.
+//!
+//! \param psCtx is the update context.
+//! \param psUpdate is the update, with the block size of psCtx negotiated.
+//!
+//! Prepared frames are usable if the boot loader takes their block size, in
+//! which case psCtx switches to it. Otherwise they are dropped and the blocks
+//! are framed as they are sent.
+//!
+//! \return This function returns the number of bytes to program.
+//
+//*****************************************************************************
+static uint32_t
+BeginTransfer(struct bmc_context *psCtx, tUpdate *psUpdate)
+{
+    tTransferWindow *psWindows = psUpdate->psWindows;
+    int32_t i32Windows = psUpdate->i32Windows;
+    int32_t i32Window;
+    uint32_t ui32Program, ui32Skipped;
+
+    if(psUpdate->ui32FrameBlock)
+    {
+        if(psUpdate->ui32FrameBlock <= psCtx->block_size)
+        {
+            psCtx->block_size = psUpdate->ui32FrameBlock;
+            msg_pdbg("Sending prepared %u byte blocks.\n", psCtx->block_size);
+        }
+        else
+        {
+            if(psUpdate->pui8Frames)
+            {
+                msg_pdbg("Negotiated block size is below the preloaded %u byte frames.\n",
+                         psUpdate->ui32FrameBlock);
+            }
+            else
+            {
+                msg_pinfo("Prepared frames do not fit, framing the image again.\n");
+            }
+            for(i32Window = 0; i32Window < i32Windows; i32Window++)
+            {
+                psWindows[i32Window].pui8Frames = 0;
+            }
+        }
+    }
+
+    ui32Program = 0;
+    ui32Skipped = psUpdate->ui32TransferLength;
+    for(i32Window = 0; i32Window < i32Windows; i32Window++)
+    {
+        ui32Skipped -= psWindows[i32Window].ui32Length;
+        if(psWindows[i32Window].bProgram)
+        {
+            ui32Program += psWindows[i32Window].ui32Length;
+        }
+    }
+    if(i32Windows > 1 || ui32Program != psUpdate->ui32TransferLength)
+    {
+        msg_pinfo("Programming %u bytes, erasing %u, leaving %u as they are, "
+                  "in %d ranges.\n", ui32Program,
+                  psUpdate->ui32TransferLength - ui32Skipped - ui32Program, ui32Skipped,
+                  i32Windows);
+    }
+    return(ui32Program);
+}
 
 //****************************************************************************
 //
@@ -370,6 +2092,8 @@ uint8_t CheckSum(uint8_t *pui8Data, uint8_t ui8Size);
 //
 //! AckPacket() sends an Acknowledge a packet.
 //!
+//! \param psCtx is the update context.
+//!
 //! This function acknowledges a packet has been received from the device.
 //!
 //! \return The function returns zero to indicated success while any non-zero
@@ -377,18 +2101,20 @@ uint8_t CheckSum(uint8_t *pui8Data, uint8_t ui8Size);
 //
 //****************************************************************************
 int32_t
-AckPacket(void)
+AckPacket(struct bmc_context *psCtx)
 {
     uint8_t ui8Ack;
 
     ui8Ack = COMMAND_ACK;
-    return(I2CSendData(&ui8Ack, 1));
+    return(TransportSendData(psCtx, &ui8Ack, 1));
 }
 
 //****************************************************************************
 //
 //! NakPacket() sends a No Acknowledge packet.
 //!
+//! \param psCtx is the update context.
+//!
 //! This function sends a no acknowledge for a packet that has been
 //! received unsuccessfully from the device.
 //!
@@ -397,68 +2123,209 @@ AckPacket(void)
 //
 //****************************************************************************
 int32_t
-NakPacket(void)
+NakPacket(struct bmc_context *psCtx)
 {
     uint8_t ui8Nak;
 
     ui8Nak = COMMAND_NAK;
-    return(I2CSendData(&ui8Nak, 1));
+    return(TransportSendData(psCtx, &ui8Nak, 1));
 }
 
 //*****************************************************************************
 //
-//! GetPacket() receives a data packet.
+//! StartPoll() sets up a wait for the boot loader to answer.
 //!
-//! \param pui8Data is the location to store the data received from the device.
-//! \param pui8Size is the number of bytes returned in the pui8Data buffer that
-//! was provided.
+//! \param psCtx is the update context.
+//! \param psPoll is the wait.
+//! \param ePoll selects the timing policy of psCtx.
+//! \param pui8Data is the location to store the response chunk.
+//! \param ui8Size is the number of bytes to read per poll.
+//! \param ui32WaitUs is how long to wait before the first read.
 //!
-//! This function receives a packet of data from UART port.
+//! The deadline of the policy counts from here. The caller may have taken
+//! the first look already and pass the first poll interval as the wait.
+//
+//*****************************************************************************
+static void
+StartPoll(struct bmc_context *psCtx, tPoll *psPoll, enum bmc_poll_type ePoll,
+          uint8_t *pui8Data, uint8_t ui8Size, uint32_t ui32WaitUs)
+{
+    uint64_t ui64Now = internal_time_usecs();
+
+    psPoll->ePoll = ePoll;
+    psPoll->pui8Data = pui8Data;
+    psPoll->ui8Size = ui8Size;
+    psPoll->ui64Deadline = ui64Now + (uint64_t)psCtx->poll_policy[ePoll].deadline_ms * 1000;
+    psPoll->ui64Next = ui64Now + ui32WaitUs;
+    psPoll->ui32Interval = psCtx->poll_policy[ePoll].initial_us;
+}
+
+//*****************************************************************************
+//
+//! StepPoll() takes one look for the answer of the boot loader.
+//!
+//! \param psCtx is the update context.
+//! \param psPoll is the wait set up by StartPoll().
+//!
+//! The boot loader returns zeros while it is busy. After an empty read the
+//! next look is due one poll interval later, in psPoll->ui64Next, and the
+//! interval doubles up to the maximum of the policy.
+//!
+//! \return This function returns zero once any byte of the chunk is
+//!     non-zero, a positive value while the answer is still to come and a
+//!     negative value if the read failed or the deadline has passed.
+//
+//*****************************************************************************
+static int32_t
+StepPoll(struct bmc_context *psCtx, tPoll *psPoll)
+{
+    const struct bmc_poll_policy *psPolicy = &psCtx->poll_policy[psPoll->ePoll];
+    uint64_t ui64Now;
+    uint8_t i;
+
+    if(TransportReceiveData(psCtx, psPoll->pui8Data, psPoll->ui8Size))
+    {
+        return(-1);
+    }
+    for(i = 0; i < psPoll->ui8Size; i++)
+    {
+        if(psPoll->pui8Data[i])
+        {
+            return(0);
+        }
+    }
+    psCtx->stats.polls[psPoll->ePoll]++;
+    ui64Now = internal_time_usecs();
+    if(ui64Now >= psPoll->ui64Deadline)
+    {
+        psCtx->stats.poll_timeouts++;
+        msg_perr("No %s from the boot loader within %u ms.\n",
+                 g_ppcPollName[psPoll->ePoll], psPolicy->deadline_ms);
+        return(-1);
+    }
+    psPoll->ui64Next = ui64Now + psPoll->ui32Interval;
+    if(psPoll->ui32Interval < psPolicy->max_us)
+    {
+        psPoll->ui32Interval *= 2;
+        if(psPoll->ui32Interval > psPolicy->max_us)
+        {
+            psPoll->ui32Interval = psPolicy->max_us;
+        }
+    }
+    return(1);
+}
+
+//*****************************************************************************
+//
+//! PollResponse() waits until the boot loader has something to say.
+//!
+//! \param ePoll selects the timing policy of psCtx.
+//! \param pui8Data is the location to store the response chunk.
+//! \param ui8Size is the number of bytes to read per poll.
+//! \param ui32WaitUs is how long to wait before the first read.
+//!
+//! This function reads until any byte of the chunk is non-zero, backing off
+//! exponentially between reads, and gives up at the deadline of the policy.
 //!
 //! \returns The function returns zero to indicated success while any non-zero
-//! value indicates a failure.
+//!     value indicates a failure.
 //
 //*****************************************************************************
-int32_t
-GetPacket(uint8_t *pui8Data, uint8_t *pui8Size)
+static int32_t
+PollResponse(struct bmc_context *psCtx, enum bmc_poll_type ePoll,
+             uint8_t *pui8Data, uint8_t ui8Size, uint32_t ui32WaitUs)
 {
-    uint8_t ui8CheckSum;
-    uint8_t ui8Size;
+    tPoll sPoll;
+    uint64_t ui64Now;
+    int32_t i32Ret;
 
-    //
-    // Get the size and the checksum.
-    //
+    StartPoll(psCtx, &sPoll, ePoll, pui8Data, ui8Size, ui32WaitUs);
     do
     {
-        if(I2CReceiveData(&ui8Size, 1))
+        ui64Now = internal_time_usecs();
+        if(sPoll.ui64Next > ui64Now)
         {
-            return(-1);
+            internal_delay(sPoll.ui64Next - ui64Now);
         }
+        i32Ret = StepPoll(psCtx, &sPoll);
     }
-    while(ui8Size == 0);
+    while(i32Ret > 0);
+
+    return(i32Ret);
+}
+
+//*****************************************************************************
+//
+//! ReadPacket() reads the rest of a packet whose size byte has come in.
+//!
+//! \param psCtx is the update context.
+//! \param ui8Size is the size byte.
+//! \param pui8Data is the location to store the data received from the device.
+//! \param pui8Size is the number of bytes returned in the pui8Data buffer.
+//!
+//! The packet is ACKed, or NAKed if its checksum is wrong.
+//!
+//! \returns The function returns zero to indicated success while any non-zero
+//! value indicates a failure.
+//
+//*****************************************************************************
+static int32_t
+ReadPacket(struct bmc_context *psCtx, uint8_t ui8Size, uint8_t *pui8Data, uint8_t *pui8Size)
+{
+    uint8_t ui8CheckSum;
 
-    if(I2CReceiveData(&ui8CheckSum, 1))
+    if(TransportReceiveData(psCtx, &ui8CheckSum, 1))
     {
         return(-1);
     }
     *pui8Size = ui8Size - 2;
 
-    if(I2CReceiveData(pui8Data, *pui8Size))
+    if(TransportReceiveData(psCtx, pui8Data, *pui8Size))
     {
         *pui8Size = 0;
         return(-1);
     }
 
     //
-    // Calculate the checksum from the data.
+    // Calculate the checksum from the data.
+    //
+    if(CheckSum(pui8Data, *pui8Size) != ui8CheckSum)
+    {
+        *pui8Size = 0;
+        return(NakPacket(psCtx));
+    }
+
+    return(AckPacket(psCtx));
+}
+
+//*****************************************************************************
+//
+//! GetPacket() receives a data packet.
+//!
+//! \param psCtx is the update context.
+//! \param pui8Data is the location to store the data received from the device.
+//! \param pui8Size is the number of bytes returned in the pui8Data buffer that
+//! was provided.
+//!
+//! This function receives a packet of data from UART port.
+//!
+//! \returns The function returns zero to indicated success while any non-zero
+//! value indicates a failure.
+//
+//*****************************************************************************
+int32_t
+GetPacket(struct bmc_context *psCtx, uint8_t *pui8Data, uint8_t *pui8Size)
+{
+    uint8_t ui8Size;
+
+    //
+    // Get the size, then the checksum and the data.
     //
-    if(CheckSum(pui8Data, *pui8Size) != ui8CheckSum)
+    if(PollResponse(psCtx, BMC_POLL_STATUS, &ui8Size, 1, 0))
     {
-        *pui8Size = 0;
-        return(NakPacket());
+        return(-1);
     }
-
-    return(AckPacket());
+    return(ReadPacket(psCtx, ui8Size, pui8Data, pui8Size));
 }
 
 //*****************************************************************************
@@ -493,6 +2360,7 @@ CheckSum(uint8_t *pui8Data, uint8_t ui8Size)
 //
 //! SendPacket() sends a data packet.
 //!
+//! \param psCtx is the update context.
 //! \param pui8Data is the location of the data to be sent to the device.
 //! \param ui8Size is the number of bytes to send from puData.
 //! \param bAck is a boolean that is true if an ACK/NAK packet should be
@@ -505,40 +2373,139 @@ CheckSum(uint8_t *pui8Data, uint8_t ui8Size)
 //
 //*****************************************************************************
 int32_t
-SendPacket(uint8_t *pui8Data, uint8_t ui8Size, uint8_t bAck)
+SendPacket(struct bmc_context *psCtx, uint8_t *pui8Data, uint8_t ui8Size, uint8_t bAck)
 {
-    uint8_t ui8CheckSum;
-    uint32_t ui32Ack;
+    uint8_t pui8Frame[256];
 
-    ui8CheckSum = CheckSum(pui8Data, ui8Size);
+    pui8Frame[0] = ui8Size + 2;
+    pui8Frame[1] = CheckSum(pui8Data, ui8Size);
+    memcpy(&pui8Frame[2], pui8Data, ui8Size);
+    return(SendFrame(psCtx, pui8Frame, bAck));
+}
 
-    //
-    // Make sure that we add the bytes for the size and checksum to the total.
-    //
-    ui8Size += 2;
-    //
-    // Send the Size in bytes.
-    //
-    if(I2CSendData(&ui8Size, 1))
+//*****************************************************************************
+//
+//! WriteFrame() puts a packet that already carries its size and checksum on
+//! the bus.
+//!
+//! \param psCtx is the update context.
+//! \param pui8Frame is the size byte, the checksum and the packet data.
+//! \param bAck is a boolean that is true if an ACK/NAK packet should be
+//! received in response to this packet.
+//! \param pui8Ack receives the first look for the ACK if the transport took
+//!     it in the same transaction, and zeros otherwise.
+//! \param pePoll receives the poll policy for the ACK.
+//! \param pui32WaitUs receives how long to wait before polling for it.
+//!
+//! \returns The function returns zero to indicated success while any non-zero
+//!     value indicates a failure.
+//
+//*****************************************************************************
+static int32_t
+WriteFrame(struct bmc_context *psCtx, const uint8_t *pui8Frame, uint8_t bAck,
+           uint8_t *pui8Ack, enum bmc_poll_type *pePoll, uint32_t *pui32WaitUs)
+{
+    uint8_t ui8Size = pui8Frame[0] - 2;
+    const uint8_t *pui8Data = &pui8Frame[2];
+
+    psCtx->stats.packets++;
+    pui8Ack[0] = 0;
+    pui8Ack[1] = 0;
+
+    if(!psCtx->legacy_framing)
     {
-        return(-1);
+        //
+        // Size, checksum and data go out in a single bus transaction.
+        //
+        if(bAck && pui8Data[0] != COMMAND_DOWNLOAD)
+        {
+            //
+            // Take the first look for the ACK in the same transaction.
+            // DOWNLOAD is left out as it never ACKs before the erase.
+            //
+            if(TransportExchange(psCtx, pui8Frame, ui8Size + 2, pui8Ack, 2))
+            {
+                return(-1);
+            }
+        }
+        else if(TransportSendData(psCtx, pui8Frame, ui8Size + 2))
+        {
+            return(-1);
+        }
     }
-    //
-    // Send the CheckSum
-    //
-    if(I2CSendData(&ui8CheckSum, 1))
+    else
     {
-        return(-1);
+        //
+        // Send the Size in bytes.
+        //
+        if(TransportSendData(psCtx, &pui8Frame[0], 1))
+        {
+            return(-1);
+        }
+        //
+        // Send the CheckSum
+        //
+        if(TransportSendData(psCtx, &pui8Frame[1], 1))
+        {
+            return(-1);
+        }
+
+        //
+        // Send the Data
+        //
+        if(TransportSendData(psCtx, pui8Data, ui8Size))
+        {
+            return(-1);
+        }
     }
-    //
-    // Now send the remaining bytes out.
-    //
-    ui8Size -= 2;
+
+    switch(pui8Data[0])
+    {
+        case COMMAND_DOWNLOAD:
+            *pePoll = BMC_POLL_ERASE;
+            break;
+        case COMMAND_SEND_DATA:
+            *pePoll = BMC_POLL_PROGRAM;
+            break;
+        default:
+            *pePoll = BMC_POLL_COMMAND;
+            break;
+    }
+    *pui32WaitUs = 0;
 
     //
-    // Send the Data
+    // A combined exchange already took the first look.
     //
-    if(I2CSendData(pui8Data, ui8Size))
+    if(bAck && pui8Ack[0] == 0 && pui8Ack[1] == 0 &&
+       !psCtx->legacy_framing && pui8Data[0] != COMMAND_DOWNLOAD)
+    {
+        psCtx->stats.polls[*pePoll]++;
+        *pui32WaitUs = psCtx->poll_policy[*pePoll].initial_us;
+    }
+    return(0);
+}
+
+//*****************************************************************************
+//
+//! SendFrame() sends a packet that already carries its size and checksum.
+//!
+//! \param psCtx is the update context.
+//! \param pui8Frame is the size byte, the checksum and the packet data.
+//! \param bAck is a boolean that is true if an ACK/NAK packet should be
+//! received in response to this packet.
+//!
+//! \returns The function returns zero to indicated success while any non-zero
+//!     value indicates a failure.
+//
+//*****************************************************************************
+int32_t
+SendFrame(struct bmc_context *psCtx, const uint8_t *pui8Frame, uint8_t bAck)
+{
+    uint8_t pui8Ack[2];
+    enum bmc_poll_type ePoll;
+    uint32_t ui32WaitUs;
+
+    if(WriteFrame(psCtx, pui8Frame, bAck, pui8Ack, &ePoll, &ui32WaitUs))
     {
         return(-1);
     }
@@ -551,24 +2518,810 @@ SendPacket(uint8_t *pui8Data, uint8_t ui8Size, uint8_t bAck)
         return(0);
     }
     //
-    // Wait for the acknowledge from the device.
+    // Wait for the acknowledge from the device. It answers with a zero byte
+    // followed by ACK or NAK, and with zeros while it is still busy.
     //
-    do
+    if(pui8Ack[0] == 0 && pui8Ack[1] == 0 &&
+       PollResponse(psCtx, ePoll, pui8Ack, sizeof(pui8Ack), ui32WaitUs))
     {
-        if(pui8Data[0]==COMMAND_DOWNLOAD)
-        {
-            // wait 9ms for each block to erase in Flash
-            delay((g_ui32FileLength/0x400 + 1)*9);
-        }
-        if(I2CReceiveData((uint8_t*)&ui32Ack, 1))
+        return(-1);
+    }
+    if(pui8Ack[1] != COMMAND_ACK)
+    {
+        return(-1);
+    }
+    return(0);
+}
+
+//****************************************************************************
+//
+// The update of RunBMCUpdater() as a state machine, see StepUpdate().
+//
+//****************************************************************************
+typedef enum
+{
+    STEP_START,
+    STEP_VERSION,               /* waiting for the preload to compare */
+    STEP_ENTER,
+    STEP_BOOT,                  /* waiting for the boot loader to start */
+    STEP_BOOT_ACKED,            /* GET_STATUS to the boot loader sent */
+    STEP_BOOT_STATUS,           /* its status packet read */
+    STEP_NEGOTIATE,
+    STEP_NEGOTIATE_ACKED,       /* padded PING sent */
+    STEP_NEGOTIATED,
+    STEP_LOAD,                  /* waiting for the preload */
+    STEP_WINDOW,
+    STEP_ERASED,                /* DOWNLOAD ACKed */
+    STEP_ERASE_CHECKED,
+    STEP_DATA,
+    STEP_DATA_ACKED,            /* SEND_DATA sent */
+    STEP_DATA_CHECKED,
+    STEP_REWIND,
+    STEP_RUN,
+    STEP_RAN,                   /* RUN or RESET sent */
+    STEP_STATUS_ACKED,          /* CheckStatus(), returns to eReturn */
+    STEP_STATUS_READ
+}
+tStepState;
+
+struct bmc_engine
+{
+    tStepState eState;
+    tStepState eReturn;
+    FILE *hFile;
+    uint64_t ui64Wake;          /* sleep until then before going on, or 0 */
+    bool bPolling;              /* sPoll is waiting for the boot loader */
+    tPoll sPoll;
+    int32_t i32Result;          /* of the last packet or status check */
+    uint8_t pui8Ack[2];
+    uint8_t pui8Frame[256];
+    uint8_t ui8PacketSize;
+    uint8_t ui8Status;
+    bool bFallBack;             /* the boot loader needed split packet writes */
+    char pcVersion[255];        /* reported by the running firmware */
+    int32_t i32Version;         /* its length, or negative if unknown */
+    uint64_t ui64Start;         /* of the phase being timed */
+
+    uint32_t ui32Good;          /* block size negotiation */
+    uint32_t ui32Bad;
+    uint32_t ui32Block;
+
+    bool bLoaded;               /* the transfer */
+    tUpdate sUpdate;
+    int32_t i32Window;
+    uint32_t ui32Offset;
+    uint32_t ui32WindowEnd;
+    uint32_t ui32Confirmed;
+    uint32_t ui32Unconfirmed;
+    uint32_t ui32Rewinds;
+    uint32_t ui32Chunk;
+    bool bRewind;               /* the DOWNLOAD in flight follows a rewind */
+    uint64_t ui64Erase;         /* when it was sent */
+    uint64_t ui64Erased;
+    uint32_t ui32Total;         /* bytes to program */
+    uint32_t ui32Remaining;
+    bool bCounter;              /* the byte counter is on screen */
+};
+
+//*****************************************************************************
+//
+//! StepProgress() shows the bytes left to program, if psCtx asks for it.
+//
+//*****************************************************************************
+static void
+StepProgress(struct bmc_context *psCtx, struct bmc_engine *psEngine)
+{
+    if(!psCtx->show_progress)
+    {
+        return;
+    }
+    if(psEngine->bCounter)
+    {
+        msg_pinfo("\b\b\b\b\b\b\b\b\b\b\b\b\b\b");
+    }
+    msg_pinfo("%08d (%02d%%)", psEngine->ui32Remaining,
+              (psEngine->ui32Total - psEngine->ui32Remaining) * 100 / psEngine->ui32Total);
+    psEngine->bCounter = true;
+}
+
+//*****************************************************************************
+//
+//! StepFrame() sends a framed packet and sets up the wait for its ACK.
+//!
+//! \param psCtx is the update context.
+//! \param psEngine is the state machine.
+//! \param pui8Frame is the size byte, the checksum and the packet data.
+//! \param eNext is the state that looks at the result.
+//
+//*****************************************************************************
+static void
+StepFrame(struct bmc_context *psCtx, struct bmc_engine *psEngine, const uint8_t *pui8Frame,
+          tStepState eNext)
+{
+    enum bmc_poll_type ePoll;
+    uint32_t ui32WaitUs;
+
+    psEngine->eState = eNext;
+    if(WriteFrame(psCtx, pui8Frame, 1, psEngine->pui8Ack, &ePoll, &ui32WaitUs))
+    {
+        psEngine->i32Result = -1;
+        return;
+    }
+    if(psEngine->pui8Ack[0] == 0 && psEngine->pui8Ack[1] == 0)
+    {
+        StartPoll(psCtx, &psEngine->sPoll, ePoll, psEngine->pui8Ack,
+                  sizeof(psEngine->pui8Ack), ui32WaitUs);
+        psEngine->bPolling = true;
+        return;
+    }
+    psEngine->i32Result = psEngine->pui8Ack[1] == COMMAND_ACK ? 0 : -1;
+}
+
+//*****************************************************************************
+//
+//! StepPacket() frames and sends a packet like SendPacket(), without waiting.
+//
+//*****************************************************************************
+static void
+StepPacket(struct bmc_context *psCtx, struct bmc_engine *psEngine, const uint8_t *pui8Data,
+           uint8_t ui8Size, tStepState eNext)
+{
+    psEngine->pui8Frame[0] = ui8Size + 2;
+    memmove(&psEngine->pui8Frame[2], pui8Data, ui8Size);
+    psEngine->pui8Frame[1] = CheckSum(&psEngine->pui8Frame[2], ui8Size);
+    StepFrame(psCtx, psEngine, psEngine->pui8Frame, eNext);
+}
+
+//*****************************************************************************
+//
+//! StepStatus() starts CheckStatus(), which goes on to eReturn with the
+//! result.
+//
+//*****************************************************************************
+static void
+StepStatus(struct bmc_context *psCtx, struct bmc_engine *psEngine, tStepState eReturn)
+{
+    psEngine->eReturn = eReturn;
+    psEngine->ui8Status = COMMAND_GET_STATUS;
+    StepPacket(psCtx, psEngine, &psEngine->ui8Status, 1, STEP_STATUS_ACKED);
+}
+
+//*****************************************************************************
+//
+//! StepRead() sets up the wait for a status packet, like GetPacket().
+//
+//*****************************************************************************
+static void
+StepRead(struct bmc_context *psCtx, struct bmc_engine *psEngine, tStepState eNext)
+{
+    psEngine->eState = eNext;
+    psEngine->ui8PacketSize = 0;
+    StartPoll(psCtx, &psEngine->sPoll, BMC_POLL_STATUS, &psEngine->ui8PacketSize, 1, 0);
+    psEngine->bPolling = true;
+}
+
+//*****************************************************************************
+//
+//! StepDownload() sends COMMAND_DOWNLOAD for the rest of the current range
+//! and sets up the wait for the erase.
+//
+//*****************************************************************************
+static void
+StepDownload(struct bmc_context *psCtx, struct bmc_engine *psEngine)
+{
+    uint32_t ui32WaitUs;
+
+    psEngine->eState = STEP_ERASED;
+    psEngine->ui64Erase = internal_time_usecs();
+    if(WriteDownload(psCtx, psEngine->sUpdate.ui32TransferStart + psEngine->ui32Offset,
+                     psEngine->ui32WindowEnd - psEngine->ui32Offset, &ui32WaitUs) < 0)
+    {
+        psEngine->i32Result = -1;
+        return;
+    }
+    psEngine->pui8Ack[0] = 0;
+    psEngine->pui8Ack[1] = 0;
+    StartPoll(psCtx, &psEngine->sPoll, BMC_POLL_ERASE, psEngine->pui8Ack,
+              sizeof(psEngine->pui8Ack), ui32WaitUs);
+    psEngine->bPolling = true;
+}
+
+//*****************************************************************************
+//
+//! StepLoad() takes the update loaded in the background once it is there.
+//!
+//! \param psCtx is the update context.
+//! \param psEngine is the state machine.
+//! \param psWait receives the descriptor to wait for while it loads.
+//!
+//! \return This function returns zero once psEngine holds the update, a
+//!     positive value while the preload is still busy and a negative value
+//!     if the image cannot be loaded.
+//
+//*****************************************************************************
+static int32_t
+StepLoad(struct bmc_context *psCtx, struct bmc_engine *psEngine, struct bmc_wait *psWait)
+{
+    struct pollfd sPollFd;
+
+    if(psEngine->bLoaded)
+    {
+        return(0);
+    }
+    if(psCtx->preload)
+    {
+        sPollFd.fd = psCtx->preload->piDone[0];
+        sPollFd.events = POLLIN;
+        if(poll(&sPollFd, 1, 0) == 0)
         {
-            return(-1);
+            psWait->fd = sPollFd.fd;
+            return(1);
         }
-    }    
-    while(ui32Ack == 0);
-    if((uint8_t)(ui32Ack>>8) != COMMAND_ACK)
+    }
+    if(GetUpdate(psCtx, &psEngine->sUpdate, psEngine->hFile, 0, psCtx->download_address) < 0)
+    {
+        return(-1);
+    }
+    psEngine->bLoaded = true;
+    return(0);
+}
+
+//*****************************************************************************
+//
+//! StartUpdate() sets up an update for StepUpdate().
+//!
+//! \param psCtx is the update context, with its transport registered.
+//! \param hApplFile is the application file or a packet file.
+//!
+//! The update takes hApplFile over and closes it when it is over, even if
+//! this function fails.
+//!
+//! \return This function returns zero on success and a negative value if
+//!     psCtx already runs an update or memory is short.
+//
+//*****************************************************************************
+int32_t
+StartUpdate(struct bmc_context *psCtx, FILE *hApplFile)
+{
+    struct bmc_engine *psEngine;
+
+    if(psCtx->engine || psCtx->preload)
+    {
+        fclose(hApplFile);
+        return(-1);
+    }
+    psEngine = calloc(1, sizeof(*psEngine));
+    if(psEngine == 0)
     {
+        fclose(hApplFile);
         return(-1);
     }
+    psEngine->eState = STEP_START;
+    psEngine->hFile = hApplFile;
+    psCtx->engine = psEngine;
     return(0);
 }
+
+//*****************************************************************************
+//
+//! AbortUpdate() drops the update StartUpdate() set up.
+//!
+//! \param psCtx is the update context.
+//!
+//! Once the first DOWNLOAD went out, the application area of the BMC is
+//! left erased, or partly programmed.
+//
+//*****************************************************************************
+void
+AbortUpdate(struct bmc_context *psCtx)
+{
+    struct bmc_engine *psEngine = psCtx->engine;
+
+    if(psEngine == 0)
+    {
+        return;
+    }
+    CancelPreload(psCtx);
+    if(psEngine->bLoaded)
+    {
+        UnloadUpdate(&psEngine->sUpdate);
+    }
+    fclose(psEngine->hFile);
+    free(psEngine);
+    psCtx->engine = 0;
+}
+
+static enum bmc_step
+FinishUpdate(struct bmc_context *psCtx, struct bmc_wait *psWait, int32_t i32Result)
+{
+    AbortUpdate(psCtx);
+    psWait->result = i32Result;
+    return(BMC_STEP_DONE);
+}
+
+//*****************************************************************************
+//
+//! StepUpdate() takes the update StartUpdate() set up as far as it can go
+//! without waiting.
+//!
+//! \param psCtx is the update context.
+//! \param psWait receives what to wait for before the next call, or the
+//!     result once the update is over.
+//!
+//! The update runs as RunBMCUpdater() would, but the restart into the boot
+//! loader, the erase and every poll for an answer become a deadline, and the
+//! image loaded in the background becomes a file descriptor to wait on. The
+//! boot loader is polled, not heard from, so deadlines should be kept to the
+//! microsecond, e.g. with a timerfd. Calling early is harmless. The bytes
+//! left are printed as the blocks go out if psCtx->show_progress is set, and
+//! psCtx->stats tells how far the update got either way.
+//!
+//! \return This function returns BMC_STEP_DONE once the update is over and
+//!     BMC_STEP_WAIT_TIME or BMC_STEP_WAIT_FD while it goes on.
+//
+//*****************************************************************************
+enum bmc_step
+StepUpdate(struct bmc_context *psCtx, struct bmc_wait *psWait)
+{
+    struct bmc_engine *psEngine = psCtx->engine;
+    tTransferWindow *psWindow;
+    uint64_t ui64Now;
+    int32_t i32Ret;
+    uint8_t ui8Size;
+
+    psWait->fd = -1;
+    psWait->deadline_us = 0;
+    if(psEngine == 0)
+    {
+        psWait->result = -1;
+        return(BMC_STEP_DONE);
+    }
+
+    while(1)
+    {
+        //
+        // Sit out a sleep, then any wait for the boot loader.
+        //
+        ui64Now = internal_time_usecs();
+        if(psEngine->ui64Wake)
+        {
+            if(ui64Now < psEngine->ui64Wake)
+            {
+                psWait->deadline_us = psEngine->ui64Wake;
+                return(BMC_STEP_WAIT_TIME);
+            }
+            psEngine->ui64Wake = 0;
+        }
+        if(psEngine->bPolling)
+        {
+            if(ui64Now < psEngine->sPoll.ui64Next)
+            {
+                psWait->deadline_us = psEngine->sPoll.ui64Next;
+                return(BMC_STEP_WAIT_TIME);
+            }
+            i32Ret = StepPoll(psCtx, &psEngine->sPoll);
+            if(i32Ret > 0)
+            {
+                continue;
+            }
+            psEngine->bPolling = false;
+            if(i32Ret < 0)
+            {
+                psEngine->i32Result = -1;
+            }
+            else if(psEngine->sPoll.ePoll == BMC_POLL_STATUS)
+            {
+                //
+                // The size byte of a status packet is in, read the rest.
+                //
+                psEngine->i32Result = ReadPacket(psCtx, psEngine->ui8PacketSize,
+                                                 &psEngine->ui8Status, &ui8Size);
+            }
+            else
+            {
+                psEngine->i32Result = psEngine->pui8Ack[1] == COMMAND_ACK ? 0 : -1;
+            }
+        }
+
+        switch(psEngine->eState)
+        {
+            case STEP_START:
+                //
+                // The running firmware has to be asked for its version
+                // before it gives way to the boot loader.
+                //
+                psEngine->i32Version = -1;
+                if(!psCtx->force_update)
+                {
+                    psEngine->i32Version = ReadVersion(psCtx, psEngine->pcVersion,
+                                                       sizeof(psEngine->pcVersion));
+                }
+                if(psEngine->i32Version > 0)
+                {
+                    msg_pdbg("Running firmware reports \"%.*s\".\n",
+                             (int)psEngine->i32Version, psEngine->pcVersion);
+                }
+
+                //
+                // Load and frame the image while the BMC restarts into the
+                // boot loader, or while the version is looked for in it.
+                //
+                PreloadUpdate(psCtx, psEngine->hFile, 0, psCtx->download_address);
+                psEngine->eState = psEngine->i32Version > 0 ? STEP_VERSION : STEP_ENTER;
+                break;
+
+            case STEP_VERSION:
+                i32Ret = StepLoad(psCtx, psEngine, psWait);
+                if(i32Ret)
+                {
+                    return(i32Ret > 0 ? BMC_STEP_WAIT_FD : FinishUpdate(psCtx, psWait, -1));
+                }
+                if(MatchVersion(psEngine->sUpdate.pui8Image, psEngine->sUpdate.ui32ImageLength,
+                                psEngine->pcVersion, psEngine->i32Version))
+                {
+                    msg_pinfo("The BMC already runs %.*s, nothing to update.\n",
+                              (int)psEngine->i32Version, psEngine->pcVersion);
+                    return(FinishUpdate(psCtx, psWait, BMC_UPDATE_CURRENT));
+                }
+                psEngine->eState = STEP_ENTER;
+                break;
+
+            case STEP_ENTER:
+                psEngine->ui64Start = internal_time_usecs();
+                psCtx->buffer[0] = COMMAND_ENTER_BOOTLOADER;
+                if(TransportEnterBootloader(psCtx, psCtx->buffer, 1) < 0)
+                {
+                    msg_pinfo("Failed to Enter Bootloader FRU Mode\n");
+                    return(FinishUpdate(psCtx, psWait, -1));
+                }
+                psEngine->ui64Wake = internal_time_usecs() + BOOTLOADER_START_MS * 1000;
+                psEngine->eState = STEP_BOOT;
+                break;
+
+            case STEP_BOOT:
+                psEngine->ui8Status = COMMAND_GET_STATUS;
+                StepPacket(psCtx, psEngine, &psEngine->ui8Status, 1, STEP_BOOT_ACKED);
+                break;
+
+            case STEP_BOOT_ACKED:
+                if(psEngine->i32Result < 0)
+                {
+                    if(psCtx->legacy_framing)
+                    {
+                        msg_pinfo("Failed to Get Bootloader Status\n");
+                        return(FinishUpdate(psCtx, psWait, -1));
+                    }
+
+                    //
+                    // Older boot loaders only take one field per bus write.
+                    // Fall back to sending size, checksum and data
+                    // separately and try again.
+                    //
+                    psCtx->legacy_framing = true;
+                    psEngine->bFallBack = true;
+                    psEngine->eState = STEP_BOOT;
+                    break;
+                }
+                if(psEngine->bFallBack)
+                {
+                    msg_pinfo("Boot loader needs split packet writes, falling back.\n");
+                }
+                StepRead(psCtx, psEngine, STEP_BOOT_STATUS);
+                break;
+
+            case STEP_BOOT_STATUS:
+                if(psEngine->i32Result < 0)
+                {
+                    msg_pinfo("Failed to Get Bootloader Packet\n");
+                    return(FinishUpdate(psCtx, psWait, -1));
+                }
+                psCtx->stats.enter_us += internal_time_usecs() - psEngine->ui64Start;
+                if(psCtx->block_size)
+                {
+                    psEngine->eState = STEP_LOAD;
+                    break;
+                }
+
+                //
+                // Find the largest data block for SEND_DATA packets. It has
+                // to fit into one transport write together with the packet
+                // framing, and into the receive buffer of the boot loader.
+                // Sizes up to SAFE_BLOCK_TRANSFER_SIZE are taken as given;
+                // anything larger is found by a binary search with padded
+                // PING packets, which the boot loader NAKs when they do not
+                // fit. Blocks stay a multiple of four since the boot loader
+                // programs whole flash words.
+                //
+                psEngine->ui32Block = MaxBlockSize(psCtx);
+                psEngine->ui32Good = psEngine->ui32Block;
+                psEngine->ui32Bad = psEngine->ui32Block;
+                if(psEngine->ui32Block > SAFE_BLOCK_TRANSFER_SIZE)
+                {
+                    psEngine->ui32Good = SAFE_BLOCK_TRANSFER_SIZE;
+                    psEngine->ui32Bad = psEngine->ui32Block + 4;
+                }
+                psEngine->eState = STEP_NEGOTIATE;
+                break;
+
+            case STEP_NEGOTIATE:
+                if(psEngine->ui32Bad - psEngine->ui32Good <= 4)
+                {
+                    psEngine->eState = STEP_NEGOTIATED;
+                    break;
+                }
+                psEngine->ui32Block = ((psEngine->ui32Good + psEngine->ui32Bad) / 2) & ~3;
+                psCtx->buffer[0] = COMMAND_PING;
+                memset(&psCtx->buffer[1], 0, psEngine->ui32Block);
+                StepPacket(psCtx, psEngine, psCtx->buffer, psEngine->ui32Block + 1,
+                           STEP_NEGOTIATE_ACKED);
+                break;
+
+            case STEP_NEGOTIATE_ACKED:
+                if(psEngine->i32Result == 0)
+                {
+                    psEngine->ui32Good = psEngine->ui32Block;
+                }
+                else
+                {
+                    msg_pdbg("Boot loader rejected %u byte blocks.\n", psEngine->ui32Block);
+                    psEngine->ui32Bad = psEngine->ui32Block;
+                }
+                psEngine->eState = STEP_NEGOTIATE;
+                break;
+
+            case STEP_NEGOTIATED:
+                if(psEngine->ui32Good < 4)
+                {
+                    msg_pinfo("Transport cannot carry a data block.\n");
+                    return(FinishUpdate(psCtx, psWait, -1));
+                }
+                psCtx->block_size = psEngine->ui32Good;
+                msg_pinfo("Using %u byte data blocks.\n", psCtx->block_size);
+                psEngine->eState = STEP_LOAD;
+                break;
+
+            case STEP_LOAD:
+                i32Ret = StepLoad(psCtx, psEngine, psWait);
+                if(i32Ret)
+                {
+                    return(i32Ret > 0 ? BMC_STEP_WAIT_FD : FinishUpdate(psCtx, psWait, -1));
+                }
+                psEngine->ui32Total = BeginTransfer(psCtx, &psEngine->sUpdate);
+                psEngine->ui32Remaining = psEngine->ui32Total;
+                if(psCtx->show_progress)
+                {
+                    msg_pinfo("Remaining Bytes: ");
+                }
+                psEngine->ui64Start = internal_time_usecs();
+                psEngine->ui64Erased = 0;
+                psEngine->i32Window = 0;
+                psEngine->eState = STEP_WINDOW;
+                break;
+
+            case STEP_WINDOW:
+                if(psEngine->i32Window == psEngine->sUpdate.i32Windows)
+                {
+                    psCtx->stats.transfer_us += internal_time_usecs() - psEngine->ui64Start -
+                                                psEngine->ui64Erased;
+                    if(psCtx->show_progress)
+                    {
+                        if(psEngine->bCounter)
+                        {
+                            msg_pinfo("\b\b\b\b\b\b\b\b\b\b\b\b\b\b");
+                        }
+                        msg_pinfo("00000000 (100%%)\n\r");
+                    }
+                    UnloadUpdate(&psEngine->sUpdate);
+                    psEngine->bLoaded = false;
+                    psEngine->eState = STEP_RUN;
+                    break;
+                }
+                psWindow = &psEngine->sUpdate.psWindows[psEngine->i32Window];
+                psEngine->ui32Offset = psWindow->ui32Start;
+                psEngine->ui32WindowEnd = psWindow->ui32Start + psWindow->ui32Length;
+                psEngine->ui32Confirmed = psEngine->ui32Offset;
+                psEngine->ui32Unconfirmed = 0;
+                psEngine->ui32Rewinds = 0;
+                psEngine->bRewind = false;
+                StepDownload(psCtx, psEngine);
+                break;
+
+            case STEP_ERASED:
+                if(psEngine->i32Result == 0)
+                {
+                    LearnEraseTime(psCtx,
+                                   psEngine->sUpdate.ui32TransferStart + psEngine->ui32Offset,
+                                   psEngine->ui32WindowEnd - psEngine->ui32Offset,
+                                   internal_time_usecs() - psEngine->ui64Erase);
+                    StepStatus(psCtx, psEngine, STEP_ERASE_CHECKED);
+                    break;
+                }
+                psEngine->eState = STEP_ERASE_CHECKED;
+                break;
+
+            case STEP_ERASE_CHECKED:
+                if(psEngine->i32Result < 0)
+                {
+                    msg_pinfo("\nFailed to Send Download Command\n");
+                    if(!psEngine->bRewind)
+                    {
+                        msg_pinfo("Flash might be erased\n");
+                    }
+                    return(FinishUpdate(psCtx, psWait, -1));
+                }
+                if(psEngine->bRewind)
+                {
+                    psEngine->ui32Confirmed = psEngine->ui32Offset;
+                    psEngine->ui32Unconfirmed = 0;
+                    if(psCtx->show_progress)
+                    {
+                        msg_pinfo("Remaining Bytes: ");
+                    }
+                    psEngine->eState = STEP_DATA;
+                    break;
+                }
+                ui64Now = internal_time_usecs() - psEngine->ui64Erase;
+                psCtx->stats.erase_us += ui64Now;
+                psEngine->ui64Erased += ui64Now;
+                psWindow = &psEngine->sUpdate.psWindows[psEngine->i32Window];
+                if(!psWindow->bProgram)
+                {
+                    psEngine->i32Window++;
+                    psEngine->eState = STEP_WINDOW;
+                    break;
+                }
+                psEngine->eState = STEP_DATA;
+                break;
+
+            case STEP_DATA:
+                if(psEngine->ui32Offset == psEngine->ui32WindowEnd)
+                {
+                    psEngine->i32Window++;
+                    psEngine->eState = STEP_WINDOW;
+                    break;
+                }
+                StepProgress(psCtx, psEngine);
+                psWindow = &psEngine->sUpdate.psWindows[psEngine->i32Window];
+                psEngine->ui32Chunk = NextBlock(psCtx, psWindow, psEngine->ui32Offset);
+                StepFrame(psCtx, psEngine,
+                          TransferFrame(psCtx, psWindow, psEngine->sUpdate.pui8Image,
+                                        psEngine->ui32Offset, psEngine->ui32Chunk,
+                                        psEngine->pui8Frame),
+                          STEP_DATA_ACKED);
+                break;
+
+            case STEP_DATA_ACKED:
+                if(psCtx->status_interval <= 1)
+                {
+                    if(psEngine->i32Result < 0)
+                    {
+                        psEngine->eState = STEP_DATA_CHECKED;
+                        break;
+                    }
+                    StepStatus(psCtx, psEngine, STEP_DATA_CHECKED);
+                    break;
+                }
+
+                //
+                // Stream the data relying on the per packet ACK and only ask
+                // for the status every status_interval blocks and after the
+                // last one of the range.
+                //
+                psEngine->ui32Offset += psEngine->ui32Chunk;
+                psEngine->ui32Remaining -= psEngine->ui32Chunk;
+                psEngine->ui32Unconfirmed++;
+                if(psEngine->i32Result < 0)
+                {
+                    psEngine->eState = STEP_REWIND;
+                }
+                else if(psEngine->ui32Unconfirmed >= psCtx->status_interval ||
+                        psEngine->ui32Offset == psEngine->ui32WindowEnd)
+                {
+                    StepStatus(psCtx, psEngine, STEP_DATA_CHECKED);
+                }
+                else
+                {
+                    psEngine->eState = STEP_DATA;
+                }
+                break;
+
+            case STEP_DATA_CHECKED:
+                if(psCtx->status_interval <= 1)
+                {
+                    if(psEngine->i32Result < 0)
+                    {
+                        msg_pinfo("\nFailed to Send Packet data\n");
+                        return(FinishUpdate(psCtx, psWait, -1));
+                    }
+                    psEngine->ui32Offset += psEngine->ui32Chunk;
+                    psEngine->ui32Remaining -= psEngine->ui32Chunk;
+                    psEngine->eState = STEP_DATA;
+                    break;
+                }
+                if(psEngine->i32Result < 0)
+                {
+                    psEngine->eState = STEP_REWIND;
+                    break;
+                }
+                psEngine->ui32Confirmed = psEngine->ui32Offset;
+                psEngine->ui32Unconfirmed = 0;
+                psEngine->eState = STEP_DATA;
+                break;
+
+            case STEP_REWIND:
+                if(++psEngine->ui32Rewinds > MAX_REWINDS)
+                {
+                    msg_pinfo("\nFailed to Send Packet data\n");
+                    return(FinishUpdate(psCtx, psWait, -1));
+                }
+                psWindow = &psEngine->sUpdate.psWindows[psEngine->i32Window];
+                psEngine->ui32Remaining += psEngine->ui32Offset;
+                psEngine->ui32Offset = RewindOffset(psEngine->sUpdate.ui32TransferStart,
+                                                    psWindow, psEngine->ui32Confirmed);
+                psEngine->ui32Remaining -= psEngine->ui32Offset;
+                psEngine->bCounter = false;
+                msg_pinfo("\nRetrying from offset 0x%08x\n", psEngine->ui32Offset);
+                psEngine->bRewind = true;
+                StepDownload(psCtx, psEngine);
+                break;
+
+            case STEP_RUN:
+                //
+                // Send the run command, or reset, but there will likely be
+                // no boot loader to answer after this command completes.
+                //
+                psEngine->ui64Start = internal_time_usecs();
+                if(psCtx->start_address != 0xffffffff)
+                {
+                    psCtx->buffer[0] = COMMAND_RUN;
+                    psCtx->buffer[1] = (uint8_t)(psCtx->start_address>>24);
+                    psCtx->buffer[2] = (uint8_t)(psCtx->start_address>>16);
+                    psCtx->buffer[3] = (uint8_t)(psCtx->start_address>>8);
+                    psCtx->buffer[4] = (uint8_t)psCtx->start_address;
+                    StepPacket(psCtx, psEngine, psCtx->buffer, 5, STEP_RAN);
+                }
+                else
+                {
+                    psCtx->buffer[0] = COMMAND_RESET;
+                    StepPacket(psCtx, psEngine, psCtx->buffer, 1, STEP_RAN);
+                }
+                break;
+
+            case STEP_RAN:
+                if(psCtx->start_address != 0xffffffff)
+                {
+                    msg_pinfo("Running from address %08x\n", psCtx->start_address);
+                }
+                else
+                {
+                    msg_pinfo("Send Reset command\n");
+                }
+                psCtx->stats.finish_us += internal_time_usecs() - psEngine->ui64Start;
+                msg_pinfo("Successfully downloaded to device.\n");
+                return(FinishUpdate(psCtx, psWait, 0));
+
+            case STEP_STATUS_ACKED:
+                if(psEngine->i32Result < 0)
+                {
+                    msg_pinfo("\nFailed to Get Status");
+                    psEngine->eState = psEngine->eReturn;
+                    break;
+                }
+                StepRead(psCtx, psEngine, STEP_STATUS_READ);
+                break;
+
+            case STEP_STATUS_READ:
+                if(psEngine->i32Result < 0)
+                {
+                    msg_pinfo("\nFailed to Get Packet");
+                }
+                else if(psEngine->ui8Status != COMMAND_RET_SUCCESS)
+                {
+                    msg_pinfo("\nCommand fails with return code: %04x", psEngine->ui8Status);
+                    psEngine->i32Result = -1;
+                }
+                psEngine->eState = psEngine->eReturn;
+                break;
+        }
+    }
+}
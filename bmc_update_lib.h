@@ -23,15 +23,194 @@
 
 #define COMMAND_ENTER_BOOTLOADER    0x51
 
-#define FILE_BUFFER_LENGTH    0x8000   /* 32kB */
 
-int32_t AckPacket(void);
-int32_t NakPacket(void);
-int32_t GetPacket(uint8_t *pui8Data, uint8_t *pui8Size);
-int32_t SendPacket(uint8_t *pui8Data, uint8_t ucSize, uint8_t bAck);
-int32_t SendCommand(uint8_t *pui8Command, uint8_t ui8Size);
+/* Largest data block that fits a packet whose size byte counts itself. */
+#define MAX_BLOCK_TRANSFER_SIZE    0xfc
+/* Block size every SEMA boot loader is known to take over SMBus. */
+#define SAFE_BLOCK_TRANSFER_SIZE   0x1c
 
-int32_t UpdateFlash(FILE *hFile, FILE *hBootFile, uint32_t ui32Address);
-int32_t EnterBootloader(uint8_t *pui8Command, uint8_t ui8Size);
+/*
+ * A transport moves raw bytes between the serial boot loader protocol below
+ * and the BMC. The protocol code never touches a bus directly; the selected
+ * programmer registers one of these before the update starts.
+ */
+struct bmc_transport {
+	const char *name;
+	/* Write ui8Size bytes to the boot loader in one bus transaction. */
+	int32_t (*send_data)(void *data, uint8_t const *pui8Data, uint8_t ui8Size);
+	/*
+	 * Read one response chunk from the boot loader. At most ui8Size bytes
+	 * are stored; if the chunk is shorter the rest of pui8Data is zeroed.
+	 */
+	int32_t (*receive_data)(void *data, uint8_t *pui8Data, uint8_t ui8Size);
+	/*
+	 * Optional: a write immediately followed by a read in one call, e.g. a
+	 * packet and the first look for its ACK.
+	 */
+	int32_t (*exchange)(void *data, uint8_t const *pui8Out, uint8_t ui8OutSize,
+			    uint8_t *pui8In, uint8_t ui8InSize);
+	/* Ask the running application to jump into the boot loader. */
+	int32_t (*enter_bootloader)(void *data, uint8_t *pui8Command, uint8_t ui8Size);
+	/*
+	 * Optional: read the version block of the running application. Returns
+	 * the number of bytes stored, or a negative value if there is none.
+	 */
+	int32_t (*read_version)(void *data, uint8_t *pui8Data, uint8_t ui8Size);
+	int (*shutdown)(void *data);
+	/* Largest number of bytes send_data() can move at once, 0 for 32. */
+	uint32_t max_transfer;
+};
+
+/*
+ * How the host waits for the boot loader to answer, per kind of request.
+ * An empty read is retried after initial_us, and the interval doubles up to
+ * max_us. The request fails once deadline_ms have passed without an answer.
+ */
+enum bmc_poll_type {
+	BMC_POLL_COMMAND,	/* ACK of PING, GET_STATUS, RUN and RESET */
+	BMC_POLL_ERASE,		/* ACK of DOWNLOAD, sent after the erase */
+	BMC_POLL_PROGRAM,	/* ACK of SEND_DATA */
+	BMC_POLL_STATUS,	/* status packet following GET_STATUS */
+	BMC_POLL_TYPES
+};
+
+struct bmc_poll_policy {
+	uint32_t initial_us;
+	uint32_t max_us;
+	uint32_t deadline_ms;
+};
+
+/*
+ * Counters for the update path. They are reset by the caller and only ever
+ * incremented by the protocol code, so benchmarks can snapshot them around
+ * any phase.
+ */
+struct bmc_stats {
+	uint32_t packets;		/* boot loader packets sent */
+	uint32_t data_packets;		/* COMMAND_SEND_DATA packets among them */
+	uint32_t writes;		/* bus write transactions */
+	uint32_t reads;			/* bus read transactions */
+	uint32_t round_trips;		/* transport calls, a combined exchange counts once */
+	uint64_t bytes_written;
+	uint64_t payload_bytes;		/* image bytes carried by SEND_DATA */
+	uint32_t polls[BMC_POLL_TYPES];	/* empty reads while waiting for an answer */
+	uint32_t poll_timeouts;		/* waits that hit their deadline */
+	/* Wall time spent in each phase of an update, in microseconds. */
+	uint64_t enter_us;
+	uint64_t erase_us;
+	uint64_t transfer_us;
+	uint64_t finish_us;
+};
+
+/* Where RunBMCUpdater() programs the application and starts it. */
+#define BMC_DOWNLOAD_ADDRESS	0x2000
+#define BMC_START_ADDRESS	0x2004
+
+struct bmc_preload;
+struct bmc_engine;
+
+/*
+ * Everything one update works with: the tunables, the statistics, the
+ * transport of the BMC and the state of the protocol code. Contexts share
+ * nothing, so BMCs can be updated side by side, each on a thread of its own.
+ * Set one up with bmc_context_init(), then let a programmer's init register
+ * its transport on it.
+ */
+struct bmc_context {
+	/* Data block of SEND_DATA, 0 negotiates the largest that works. */
+	uint32_t block_size;
+	/* SEND_DATA blocks between two GET_STATUS checks, 1 checks every block. */
+	uint32_t status_interval;
+	struct bmc_poll_policy poll_policy[BMC_POLL_TYPES];
+	/* Send size, checksum and data as three bus writes instead of one frame. */
+	bool legacy_framing;
+	/* Print the byte counter while programming. */
+	bool show_progress;
+	/* Reflash even if the BMC already runs the image. */
+	bool force_update;
+	/* Image the application area holds now, only changed pages are reflashed. */
+	FILE *base_file;
+	/*
+	 * Directory of packet files shared by all updates of the same image,
+	 * NULL frames every update on its own.
+	 */
+	const char *image_cache;
+	uint32_t download_address;
+	/* RUN address after the update, 0xffffffff sends RESET instead. */
+	uint32_t start_address;
+	/* Flash page erase time learned from DOWNLOAD, 0 if not known yet. */
+	uint32_t erase_page_us;
+	struct bmc_stats stats;
+
+	/* Set by register_bmc_transport(). */
+	const struct bmc_transport *transport;
+	void *transport_data;
+	/* Names the BMC in the erase time file, e.g. its bus and address. */
+	char device[256];
+
+	/* Owned by the protocol code. */
+	uint8_t buffer[256];
+	struct bmc_preload *preload;
+	struct bmc_engine *engine;
+};
+
+void bmc_context_init(struct bmc_context *ctx);
+int register_bmc_transport(struct bmc_context *ctx, const struct bmc_transport *transport,
+			   void *data);
+int bmc_transport_shutdown(struct bmc_context *ctx);
+
+/*
+ * Programmers. params holds their comma separated key=value parameters, or
+ * is NULL, and is left alone.
+ */
+/* dummybmc.c */
+int dummy_bmc_init(struct bmc_context *ctx, const char *params);
+/* i2cbmc.c */
+int i2c_bmc_init(struct bmc_context *ctx, const char *params);
+
+int32_t AckPacket(struct bmc_context *psCtx);
+int32_t NakPacket(struct bmc_context *psCtx);
+int32_t GetPacket(struct bmc_context *psCtx, uint8_t *pui8Data, uint8_t *pui8Size);
+int32_t SendPacket(struct bmc_context *psCtx, uint8_t *pui8Data, uint8_t ucSize, uint8_t bAck);
+int32_t SendFrame(struct bmc_context *psCtx, const uint8_t *pui8Frame, uint8_t bAck);
+int32_t SendCommand(struct bmc_context *psCtx, uint8_t *pui8Command, uint8_t ui8Size);
+int32_t CheckStatus(struct bmc_context *psCtx);
+int32_t ReadVersion(struct bmc_context *psCtx, char *pcVersion, uint32_t ui32Size);
+int32_t CheckImageVersion(FILE *hFile, const char *pcVersion, int32_t i32Length);
+void LoadEraseTiming(struct bmc_context *psCtx, const char *pcPath);
+int32_t SaveEraseTiming(struct bmc_context *psCtx, const char *pcPath);
+
+int32_t PrepareImage(FILE *hFile, FILE *hOut, uint32_t ui32Address,
+                     uint32_t ui32BlockSize);
+
+/*
+ * An update as a state machine, for event loops that drive many BMCs from
+ * one thread. StartUpdate() takes the image; every StepUpdate() then does
+ * the bus work that is due without sleeping and says what to wait for
+ * before the next call. Only the bus transactions themselves block.
+ * RunBMCUpdater() is the same update, sleeping through every wait.
+ */
+enum bmc_step {
+	BMC_STEP_DONE,		/* result holds what RunBMCUpdater() would return */
+	BMC_STEP_WAIT_TIME,	/* call again at deadline_us */
+	BMC_STEP_WAIT_FD,	/* call again once fd is readable */
+};
+
+struct bmc_wait {
+	int fd;
+	/* On the CLOCK_MONOTONIC time line, in microseconds. */
+	uint64_t deadline_us;
+	int32_t result;
+};
+
+int32_t StartUpdate(struct bmc_context *psCtx, FILE *hApplFile);
+enum bmc_step StepUpdate(struct bmc_context *psCtx, struct bmc_wait *psWait);
+void AbortUpdate(struct bmc_context *psCtx);
+
+/* ad_bmc_updater.c */
+/* RunBMCUpdater() found the image already running and did nothing. */
+#define BMC_UPDATE_CURRENT	1
+int32_t RunBMCUpdater(struct bmc_context *psCtx, FILE *hApplFile);
+int32_t PrepareBMCImage(struct bmc_context *psCtx, FILE *hApplFile, FILE *hPacketFile);
 
 #endif
\ No newline at end of file
@@ -0,0 +1,282 @@
+/*
+ * This file is part of the flashrom project.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; version 2 of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+/*
+ * Throughput benchmark for the BMC update path.
+ *
+ * Runs RunBMCUpdater() end to end against the dummy programmer for every
+ * combination of image size and block transfer size, checks that the
+ * emulated flash ends up holding the image, and prints per-phase wall time
+ * together with bus and packet rates.
+ *
+ * Usage: bmcbench [-l] [-e] [-c interval] [-s size,...] [-b blocksize,...] [-p dummy-params]
+ *
+ * -l measures the legacy split size/checksum/data packet writes.
+ * -e drives the update through StepUpdate() from a poll() loop instead.
+ * -c N sets the number of data blocks between two status checks.
+ * A block size of 0 lets the update negotiate one.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <getopt.h>
+#include <poll.h>
+#include <sys/timerfd.h>
+#include "flash.h"
+#include "bmc_update_lib.h"
+
+/* udelay.c */
+uint64_t internal_time_usecs(void);
+
+#define BENCH_MAX_RUNS		16
+
+/* -c, 0 keeps the default of bmc_context_init(). */
+static uint32_t status_interval;
+/* -e */
+static bool use_engine;
+
+static unsigned int parse_list(const char *arg, unsigned long *list)
+{
+	unsigned int n = 0;
+	char *endptr;
+
+	while (*arg && n < BENCH_MAX_RUNS) {
+		list[n++] = strtoul(arg, &endptr, 0);
+		if (endptr == arg || (*endptr && *endptr != ',')) {
+			fprintf(stderr, "Error: bad number list \"%s\".\n", arg);
+			exit(1);
+		}
+		arg = *endptr ? endptr + 1 : endptr;
+	}
+	return n;
+}
+
+static int check_flash(const char *flashfile, const uint8_t *image, unsigned long size)
+{
+	uint8_t *buf;
+	FILE *f;
+	int ret = 1;
+
+	buf = malloc(size);
+	if (!buf)
+		return 1;
+	f = fopen(flashfile, "rb");
+	if (f && !fseek(f, BMC_DOWNLOAD_ADDRESS, SEEK_SET) && fread(buf, 1, size, f) == size)
+		ret = memcmp(buf, image, size) != 0;
+	if (f)
+		fclose(f);
+	free(buf);
+	return ret;
+}
+
+/*
+ * Run the update as an event driven program would: sleep in poll() until the
+ * deadline, kept by a timerfd, or the descriptor StepUpdate() asks for.
+ */
+static int run_engine(struct bmc_context *ctx, FILE *f)
+{
+	struct itimerspec its = { { 0, 0 }, { 0, 0 } };
+	struct pollfd pfd[2];
+	struct bmc_wait wait;
+	enum bmc_step step;
+	int tfd;
+
+	tfd = timerfd_create(CLOCK_MONOTONIC, 0);
+	if (tfd < 0) {
+		fprintf(stderr, "Error: timerfd_create failed: %s\n", strerror(errno));
+		fclose(f);
+		return 1;
+	}
+	if (StartUpdate(ctx, f)) {
+		close(tfd);
+		return 1;
+	}
+	while ((step = StepUpdate(ctx, &wait)) != BMC_STEP_DONE) {
+		pfd[0].fd = tfd;
+		pfd[0].events = POLLIN;
+		pfd[1].fd = wait.fd;
+		pfd[1].events = POLLIN;
+		its.it_value.tv_sec = 0;
+		its.it_value.tv_nsec = 0;
+		if (step == BMC_STEP_WAIT_TIME) {
+			its.it_value.tv_sec = wait.deadline_us / 1000000;
+			its.it_value.tv_nsec = wait.deadline_us % 1000000 * 1000;
+		}
+		/* A zero it_value disarms the timer. */
+		timerfd_settime(tfd, TFD_TIMER_ABSTIME, &its, NULL);
+		if (poll(pfd, 2, -1) < 0 && errno != EINTR)
+			break;
+		if (pfd[0].revents & POLLIN) {
+			uint64_t expirations;
+
+			if (read(tfd, &expirations, sizeof(expirations)) < 0)
+				break;
+		}
+	}
+	close(tfd);
+	if (step != BMC_STEP_DONE) {
+		AbortUpdate(ctx);
+		return 1;
+	}
+	return wait.result < 0;
+}
+
+static int bench_one(unsigned long size, unsigned long block, bool legacy,
+		     const char *dummy_params)
+{
+	char flashfile[] = "/tmp/bmcbench.XXXXXX";
+	struct bmc_context ctx;
+	char *pparam;
+	uint8_t *image;
+	uint64_t start, total;
+	unsigned long i;
+	FILE *f;
+	int fd, ret;
+
+	fd = mkstemp(flashfile);
+	if (fd < 0) {
+		fprintf(stderr, "Error: mkstemp failed: %s\n", strerror(errno));
+		return 1;
+	}
+	close(fd);
+
+	image = malloc(size);
+	f = tmpfile();
+	if (!image || !f) {
+		fprintf(stderr, "Error: cannot prepare a %lu byte image.\n", size);
+		free(image);
+		unlink(flashfile);
+		return 1;
+	}
+	/* Deterministic, incompressible-looking data. */
+	srand(size ^ block);
+	for (i = 0; i < size; i++)
+		image[i] = rand();
+	fwrite(image, 1, size, f);
+	rewind(f);
+
+	i = strlen(flashfile) + strlen(dummy_params) + sizeof("image=,");
+	pparam = malloc(i);
+	if (!pparam) {
+		fclose(f);
+		free(image);
+		unlink(flashfile);
+		return 1;
+	}
+	snprintf(pparam, i, "image=%s%s%s", flashfile, *dummy_params ? "," : "", dummy_params);
+	bmc_context_init(&ctx);
+	ctx.block_size = block;
+	if (status_interval)
+		ctx.status_interval = status_interval;
+	ctx.legacy_framing = legacy;
+	ret = dummy_bmc_init(&ctx, pparam);
+	if (ret) {
+		fclose(f);
+	} else {
+		start = internal_time_usecs();
+		/* Both close the image file. */
+		if (use_engine)
+			ret = run_engine(&ctx, f);
+		else
+			ret = RunBMCUpdater(&ctx, f);
+		total = internal_time_usecs() - start;
+		ret |= bmc_transport_shutdown(&ctx);
+	}
+	if (!ret && check_flash(flashfile, image, size)) {
+		fprintf(stderr, "Error: flash contents differ from the image.\n");
+		ret = 1;
+	}
+
+	if (ret) {
+		printf("%8lu %5lu  FAILED\n", size, block);
+	} else {
+		printf("%8lu %5u %8.3f %8.1f %8.1f %9.1f %7.1f %9.0f %8.0f %8.1f %6u\n",
+		       size, ctx.block_size, total / 1e6,
+		       ctx.stats.enter_us / 1e3, ctx.stats.erase_us / 1e3,
+		       ctx.stats.transfer_us / 1e3, ctx.stats.finish_us / 1e3,
+		       size * 1e6 / total, ctx.stats.packets * 1e6 / total,
+		       ctx.stats.round_trips * 1024.0 / size,
+		       ctx.stats.polls[BMC_POLL_COMMAND] + ctx.stats.polls[BMC_POLL_ERASE] +
+		       ctx.stats.polls[BMC_POLL_PROGRAM] + ctx.stats.polls[BMC_POLL_STATUS]);
+	}
+
+	free(pparam);
+	free(image);
+	unlink(flashfile);
+	return ret;
+}
+
+int main(int argc, char *argv[])
+{
+	unsigned long sizes[BENCH_MAX_RUNS] = { 4096, 16384 };
+	unsigned long blocks[BENCH_MAX_RUNS] = { 0x08, 0x10, 0x1c, 0 };
+	unsigned int nsizes = 2, nblocks = 4, i, j;
+	const char *dummy_params = "";
+	bool legacy = false;
+	int opt, ret = 0;
+
+	while ((opt = getopt(argc, argv, "lec:s:b:p:")) != -1) {
+		switch (opt) {
+		case 'l':
+			legacy = true;
+			break;
+		case 'e':
+			use_engine = true;
+			break;
+		case 'c':
+			status_interval = strtoul(optarg, NULL, 0);
+			break;
+		case 's':
+			nsizes = parse_list(optarg, sizes);
+			break;
+		case 'b':
+			nblocks = parse_list(optarg, blocks);
+			break;
+		case 'p':
+			dummy_params = optarg;
+			break;
+		default:
+			fprintf(stderr, "Usage: %s [-l] [-e] [-c interval] [-s size,...] [-b blocksize,...] [-p dummy-params]\n",
+				argv[0]);
+			return 1;
+		}
+	}
+	for (j = 0; j < nblocks; j++) {
+		if (blocks[j] > MAX_BLOCK_TRANSFER_SIZE) {
+			fprintf(stderr, "Error: block size %lu out of range.\n", blocks[j]);
+			return 1;
+		}
+	}
+
+	/* Keep the progress counter of the update out of the table. */
+	verbose_screen = MSG_WARN;
+
+	printf("    size block  total_s enter_ms erase_ms  xfer_ms  fin_ms       B/s    pkt/s   rt/KiB  polls\n");
+	for (i = 0; i < nsizes; i++)
+		for (j = 0; j < nblocks; j++)
+			ret |= bench_one(sizes[i], blocks[j], legacy, dummy_params);
+	if (delay_stats.count)
+		printf("\ndelay(): %lu calls, %.1f ms requested, %.1f us late on average, "
+		       "%llu us at worst, %.1f ms spinning\n", delay_stats.count,
+		       delay_stats.requested_us / 1e3,
+		       (double)delay_stats.late_us / delay_stats.count,
+		       (unsigned long long)delay_stats.max_late_us, delay_stats.spin_us / 1e3);
+	return ret;
+}
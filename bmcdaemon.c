@@ -0,0 +1,926 @@
+/*
+ * This file is part of the flashrom project.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; version 2 of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+/*
+ * bmcflash --daemon SOCKET: an update service for many BMCs.
+ *
+ * The daemon keeps the bus of every BMC it has worked on open, along with
+ * what it learned about it (block size, erase time), and keeps recently used
+ * images in memory, gzip images already inflated. Clients connect to the
+ * UNIX socket and send one command per line; each gets one reply line.
+ *
+ *   flash TARGET IMAGE [force]	queue an update, replies "ok ID"
+ *   verify TARGET IMAGE	queue a check whether the BMC runs IMAGE
+ *   probe TARGET		queue a read of the running version
+ *   status ID			"ID KIND TARGET STATE [DETAIL]"
+ *   wait ID			the status line, once the job has finished
+ *   list			a status line per job, then a line "."
+ *   close TARGET		release the bus of an idle BMC
+ *
+ * TARGET is what dev= (image= for dummy) names on the command line, IMAGE an
+ * absolute path. Failed commands are answered with "error MESSAGE". STATE is
+ * queued, running, done or failed. Jobs start in the order they came in, one
+ * per bus at a time. Each running job has a thread of its own, since the bus
+ * transactions block, while one poll() loop serves the clients. If targets
+ * are given with -p, only those are served and their buses are opened right
+ * away.
+ *
+ * SIGTERM or SIGINT stops taking jobs, fails the queued ones and exits once
+ * the running ones are done. A second signal exits right away and leaves the
+ * BMCs being updated to a later update.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/signalfd.h>
+#include "flash.h"
+#include "bmc_update_lib.h"
+
+/* cli_classic.c */
+FILE *open_image(const char *filename);
+FILE *reopen_image(FILE *image);
+int bmc_same_bus(const char *a, const char *b);
+/* cli_output.c */
+char *extract_programmer_param(const char *param_name);
+/* udelay.c */
+uint64_t internal_time_usecs(void);
+
+#define DAEMON_MAX_CLIENTS	64
+#define DAEMON_MAX_TARGETS	64
+/* Images kept in memory, including those no job needs any more. */
+#define DAEMON_CACHED_IMAGES	16
+/* Finished jobs whose status can still be asked for. */
+#define DAEMON_KEPT_JOBS	1024
+#define DAEMON_LINE_MAX		1024
+
+enum daemon_job_kind {
+	JOB_FLASH,
+	JOB_VERIFY,
+	JOB_PROBE,
+};
+
+enum daemon_job_state {
+	JOB_QUEUED,
+	JOB_RUNNING,
+	JOB_DONE,
+	JOB_FAILED,
+};
+
+static const char *const job_kind_names[] = { "flash", "verify", "probe" };
+static const char *const job_state_names[] = { "queued", "running", "done", "failed" };
+
+struct daemon_image {
+	char *path;
+	/* The file as it was read; once it changes, it is read again. */
+	dev_t dev;
+	ino_t ino;
+	off_t size;
+	struct timespec mtime;
+	/* As open_image() returned it. Jobs open a file of their own on it. */
+	FILE *file;
+	/* Jobs holding it. A stale image is freed once the last one is done. */
+	unsigned int users;
+	bool stale;
+	uint64_t last_used;
+	struct daemon_image *next;
+};
+
+struct daemon_target {
+	struct daemon *dmn;
+	char *name;
+	/* Stays set up between jobs while open is set. */
+	struct bmc_context ctx;
+	bool open;
+	/* While job runs, only its thread touches ctx. */
+	struct daemon_job *job;
+	pthread_t thread;
+};
+
+struct daemon_job {
+	unsigned long id;
+	enum daemon_job_kind kind;
+	enum daemon_job_state state;
+	bool force;
+	struct daemon_target *target;
+	struct daemon_image *image;
+	/* Set by the thread of the job, read once it is done. */
+	bool failed;
+	char detail[128];
+	uint64_t started_us;
+	struct daemon_job *next;
+};
+
+struct daemon_client {
+	int fd;
+	char buf[DAEMON_LINE_MAX];
+	size_t len;
+	/* Job whose end this client waits for, 0 if none. */
+	unsigned long wait_id;
+};
+
+struct daemon {
+	const struct bmc_context *tmpl;
+	int (*init)(struct bmc_context *ctx, const char *params);
+	const char *target_param;
+	const char *params;
+	const char *erase_cache;
+	/* Only the targets given on the command line are served. */
+	bool fixed_targets;
+	const char *socket_path;
+	/* -1 once stopping. */
+	int listen_fd;
+	/* Job threads write their target here when they are done. */
+	int done_pipe[2];
+
+	struct daemon_client clients[DAEMON_MAX_CLIENTS];
+	unsigned int nclients;
+	struct daemon_target *targets[DAEMON_MAX_TARGETS];
+	unsigned int ntargets;
+	struct daemon_image *images;
+	struct daemon_job *jobs, **jobs_tail;
+	unsigned long last_id;
+	unsigned int finished;
+};
+
+static void free_image(struct daemon_image *img)
+{
+	fclose(img->file);
+	free(img->path);
+	free(img);
+}
+
+/* Drop stale images nobody holds, then the least recently used beyond the cap. */
+static void trim_images(struct daemon *dmn)
+{
+	struct daemon_image **pp, **lru, *img;
+	unsigned int count;
+
+	while (1) {
+		count = 0;
+		lru = NULL;
+		for (pp = &dmn->images; *pp;) {
+			img = *pp;
+			if (img->stale && !img->users) {
+				*pp = img->next;
+				free_image(img);
+				continue;
+			}
+			count++;
+			if (!img->users && (!lru || img->last_used < (*lru)->last_used))
+				lru = pp;
+			pp = &img->next;
+		}
+		if (count <= DAEMON_CACHED_IMAGES || !lru)
+			return;
+		img = *lru;
+		*lru = img->next;
+		free_image(img);
+	}
+}
+
+/* Find path in the cache or read it. The caller holds the image until release_image(). */
+static struct daemon_image *get_image(struct daemon *dmn, const char *path)
+{
+	struct daemon_image *img;
+	struct stat st;
+
+	if (stat(path, &st)) {
+		msg_perr("Error: opening file \"%s\" failed: %s\n", path, strerror(errno));
+		return NULL;
+	}
+	for (img = dmn->images; img; img = img->next) {
+		if (img->stale || strcmp(img->path, path))
+			continue;
+		if (img->dev == st.st_dev && img->ino == st.st_ino && img->size == st.st_size &&
+		    img->mtime.tv_sec == st.st_mtim.tv_sec &&
+		    img->mtime.tv_nsec == st.st_mtim.tv_nsec)
+			break;
+		img->stale = true;
+	}
+	if (!img) {
+		img = calloc(1, sizeof(*img));
+		if (!img || !(img->path = strdup(path))) {
+			free(img);
+			return NULL;
+		}
+		img->file = open_image(path);
+		if (!img->file) {
+			free(img->path);
+			free(img);
+			return NULL;
+		}
+		img->dev = st.st_dev;
+		img->ino = st.st_ino;
+		img->size = st.st_size;
+		img->mtime = st.st_mtim;
+		img->next = dmn->images;
+		dmn->images = img;
+		msg_pdbg("Cached %s.\n", path);
+	}
+	img->users++;
+	img->last_used = internal_time_usecs();
+	trim_images(dmn);
+	return img;
+}
+
+static void release_image(struct daemon *dmn, struct daemon_image *img)
+{
+	img->users--;
+	trim_images(dmn);
+}
+
+static struct daemon_target *find_target(struct daemon *dmn, const char *name)
+{
+	unsigned int i;
+
+	for (i = 0; i < dmn->ntargets; i++)
+		if (!strcmp(dmn->targets[i]->name, name))
+			return dmn->targets[i];
+	return NULL;
+}
+
+static struct daemon_target *add_target(struct daemon *dmn, const char *name)
+{
+	struct daemon_target *t;
+
+	if (dmn->ntargets == DAEMON_MAX_TARGETS)
+		return NULL;
+	t = calloc(1, sizeof(*t));
+	if (!t || !(t->name = strdup(name))) {
+		free(t);
+		return NULL;
+	}
+	t->dmn = dmn;
+	dmn->targets[dmn->ntargets++] = t;
+	return t;
+}
+
+/* Set up the context of t and its transport, unless that is done already. */
+static int open_target(struct daemon *dmn, struct daemon_target *t)
+{
+	char *param;
+	size_t len;
+
+	if (t->open)
+		return 0;
+	len = strlen(dmn->target_param) + strlen(t->name) + strlen(dmn->params) + 3;
+	param = malloc(len);
+	if (!param)
+		return -1;
+	snprintf(param, len, "%s=%s%s%s", dmn->target_param, t->name,
+		 *dmn->params ? "," : "", dmn->params);
+	t->ctx = *dmn->tmpl;
+	t->ctx.show_progress = false;
+	if (dmn->init(&t->ctx, param)) {
+		free(param);
+		return -1;
+	}
+	free(param);
+	if (dmn->erase_cache)
+		LoadEraseTiming(&t->ctx, dmn->erase_cache);
+	t->open = true;
+	msg_pinfo("%s: opened.\n", t->name);
+	return 0;
+}
+
+static void close_target(struct daemon_target *t)
+{
+	if (!t->open)
+		return;
+	if (bmc_transport_shutdown(&t->ctx))
+		msg_perr("%s: closing failed.\n", t->name);
+	t->open = false;
+	msg_pinfo("%s: closed.\n", t->name);
+}
+
+static bool bus_busy(const struct daemon *dmn, const struct daemon_target *t)
+{
+	unsigned int i;
+
+	for (i = 0; i < dmn->ntargets; i++)
+		if (dmn->targets[i]->job && bmc_same_bus(dmn->targets[i]->name, t->name))
+			return true;
+	return false;
+}
+
+static void job_status(const struct daemon_job *job, char *buf, size_t size)
+{
+	int len;
+
+	len = snprintf(buf, size, "%lu %s %s %s", job->id, job_kind_names[job->kind],
+		       job->target->name, job_state_names[job->state]);
+	if (len < 0 || (size_t)len >= size)
+		return;
+	if (job->state == JOB_RUNNING)
+		snprintf(buf + len, size - len, " %.1f s",
+			 (internal_time_usecs() - job->started_us) / 1e6);
+	else if (*job->detail)
+		snprintf(buf + len, size - len, " %s", job->detail);
+}
+
+/* Send one reply line. A client that does not read its replies is dropped. */
+static void client_reply(struct daemon_client *c, const char *fmt, ...)
+{
+	char line[DAEMON_LINE_MAX];
+	va_list ap;
+	int len;
+
+	if (c->fd < 0)
+		return;
+	va_start(ap, fmt);
+	len = vsnprintf(line, sizeof(line) - 1, fmt, ap);
+	va_end(ap);
+	if (len < 0)
+		return;
+	if ((size_t)len > sizeof(line) - 2)
+		len = sizeof(line) - 2;
+	line[len++] = '\n';
+	if (send(c->fd, line, len, MSG_DONTWAIT | MSG_NOSIGNAL) != len) {
+		close(c->fd);
+		c->fd = -1;
+	}
+}
+
+static void client_process(struct daemon *dmn, struct daemon_client *c);
+
+/* Mark job finished and answer the clients waiting for it. */
+static void job_end(struct daemon *dmn, struct daemon_job *job)
+{
+	char line[DAEMON_LINE_MAX];
+	unsigned int i;
+
+	job->state = job->failed ? JOB_FAILED : JOB_DONE;
+	if (job->target->job == job)
+		job->target->job = NULL;
+	if (job->image) {
+		release_image(dmn, job->image);
+		job->image = NULL;
+	}
+	dmn->finished++;
+
+	job_status(job, line, sizeof(line));
+	msg_pinfo("Job %s\n", line);
+	for (i = 0; i < dmn->nclients; i++) {
+		if (dmn->clients[i].wait_id != job->id)
+			continue;
+		dmn->clients[i].wait_id = 0;
+		client_reply(&dmn->clients[i], "%s", line);
+		client_process(dmn, &dmn->clients[i]);
+	}
+}
+
+static void job_fail(struct daemon *dmn, struct daemon_job *job, const char *why)
+{
+	job->failed = true;
+	snprintf(job->detail, sizeof(job->detail), "%s", why);
+	job_end(dmn, job);
+}
+
+/* Forget the oldest finished jobs beyond DAEMON_KEPT_JOBS. */
+static void prune_jobs(struct daemon *dmn)
+{
+	struct daemon_job **pp = &dmn->jobs, *job;
+
+	while (dmn->finished > DAEMON_KEPT_JOBS && *pp) {
+		job = *pp;
+		if (job->state != JOB_DONE && job->state != JOB_FAILED) {
+			pp = &job->next;
+			continue;
+		}
+		*pp = job->next;
+		if (dmn->jobs_tail == &job->next)
+			dmn->jobs_tail = pp;
+		free(job);
+		dmn->finished--;
+	}
+}
+
+/* Run the job of t on its thread, then hand t back to the main loop. */
+static void *job_thread(void *arg)
+{
+	struct daemon_target *t = arg;
+	struct daemon *dmn = t->dmn;
+	struct daemon_job *job = t->job;
+	char version[256];
+	int32_t len, ret;
+	FILE *f = NULL;
+
+	job->failed = true;
+	if (open_target(dmn, t)) {
+		snprintf(job->detail, sizeof(job->detail), "cannot open the BMC");
+		goto out;
+	}
+	memset(&t->ctx.stats, 0, sizeof(t->ctx.stats));
+	if (job->image && !(f = reopen_image(job->image->file))) {
+		snprintf(job->detail, sizeof(job->detail), "cannot open the image: %s",
+			 strerror(errno));
+		goto out;
+	}
+
+	switch (job->kind) {
+	case JOB_PROBE:
+	case JOB_VERIFY:
+		/* The boot loader cannot read the flash back, so compare versions. */
+		len = ReadVersion(&t->ctx, version, sizeof(version));
+		if (len < 0) {
+			snprintf(job->detail, sizeof(job->detail), "no version");
+		} else if (job->kind == JOB_PROBE) {
+			job->failed = false;
+			snprintf(job->detail, sizeof(job->detail), "%.*s", (int)len, version);
+		} else {
+			job->failed = false;
+			snprintf(job->detail, sizeof(job->detail), "%s %.*s",
+				 CheckImageVersion(f, version, len) ? "current" : "differs",
+				 (int)len, version);
+		}
+		if (f)
+			fclose(f);
+		break;
+	case JOB_FLASH:
+		t->ctx.force_update = job->force || dmn->tmpl->force_update;
+		/* Closes f. */
+		ret = RunBMCUpdater(&t->ctx, f);
+		if (ret == 0) {
+			if (dmn->erase_cache)
+				SaveEraseTiming(&t->ctx, dmn->erase_cache);
+			job->failed = false;
+			snprintf(job->detail, sizeof(job->detail), "updated in %.1f s",
+				 (internal_time_usecs() - job->started_us) / 1e6);
+		} else if (ret == BMC_UPDATE_CURRENT) {
+			job->failed = false;
+			snprintf(job->detail, sizeof(job->detail), "current");
+		} else {
+			/* Start over from a fresh transport next time. */
+			close_target(t);
+			snprintf(job->detail, sizeof(job->detail), "update failed");
+		}
+		break;
+	}
+out:
+	if (write(dmn->done_pipe[1], &t, sizeof(t)) != sizeof(t))
+		msg_perr("%s: cannot signal the end of job %lu.\n", t->name, job->id);
+	return NULL;
+}
+
+static void job_start(struct daemon *dmn, struct daemon_job *job)
+{
+	struct daemon_target *t = job->target;
+
+	job->state = JOB_RUNNING;
+	job->started_us = internal_time_usecs();
+	t->job = job;
+	if (pthread_create(&t->thread, NULL, job_thread, t))
+		job_fail(dmn, job, "cannot start a thread");
+}
+
+/* Collect the jobs whose threads are done. */
+static void jobs_done(struct daemon *dmn)
+{
+	struct daemon_target *t;
+
+	while (read(dmn->done_pipe[0], &t, sizeof(t)) == sizeof(t)) {
+		pthread_join(t->thread, NULL);
+		job_end(dmn, t->job);
+	}
+}
+
+static bool jobs_running(const struct daemon *dmn)
+{
+	unsigned int i;
+
+	for (i = 0; i < dmn->ntargets; i++)
+		if (dmn->targets[i]->job)
+			return true;
+	return false;
+}
+
+/* Start queued jobs, oldest first, whose bus is free. */
+static void schedule_jobs(struct daemon *dmn)
+{
+	struct daemon_job *job;
+
+	for (job = dmn->jobs; job; job = job->next)
+		if (job->state == JOB_QUEUED && !bus_busy(dmn, job->target))
+			job_start(dmn, job);
+}
+
+static void submit_job(struct daemon *dmn, struct daemon_client *c, enum daemon_job_kind kind,
+		       int argc, char **argv)
+{
+	struct daemon_target *t;
+	struct daemon_job *job;
+	int want = kind == JOB_PROBE ? 2 : 3;
+
+	if (argc < want || argc > want + (kind == JOB_FLASH) ||
+	    (argc == 4 && strcmp(argv[3], "force"))) {
+		client_reply(c, "error usage: %s TARGET%s", job_kind_names[kind],
+			     kind == JOB_PROBE ? "" : kind == JOB_FLASH ? " IMAGE [force]" : " IMAGE");
+		return;
+	}
+	if (dmn->listen_fd < 0) {
+		client_reply(c, "error daemon stopping");
+		return;
+	}
+	if (strchr(argv[1], ',')) {
+		client_reply(c, "error bad target %s", argv[1]);
+		return;
+	}
+	if (kind != JOB_PROBE && argv[2][0] != '/') {
+		client_reply(c, "error image path must be absolute");
+		return;
+	}
+	t = find_target(dmn, argv[1]);
+	if (!t && dmn->fixed_targets) {
+		client_reply(c, "error unknown target %s", argv[1]);
+		return;
+	}
+	if (!t && !(t = add_target(dmn, argv[1]))) {
+		client_reply(c, "error too many targets");
+		return;
+	}
+	job = calloc(1, sizeof(*job));
+	if (!job) {
+		client_reply(c, "error out of memory");
+		return;
+	}
+	if (kind != JOB_PROBE && !(job->image = get_image(dmn, argv[2]))) {
+		free(job);
+		client_reply(c, "error cannot read %s", argv[2]);
+		return;
+	}
+	job->id = ++dmn->last_id;
+	job->kind = kind;
+	job->state = JOB_QUEUED;
+	job->force = argc == 4;
+	job->target = t;
+	*dmn->jobs_tail = job;
+	dmn->jobs_tail = &job->next;
+	client_reply(c, "ok %lu", job->id);
+}
+
+static struct daemon_job *find_job(struct daemon *dmn, const char *arg)
+{
+	struct daemon_job *job;
+	unsigned long id;
+	char *endptr;
+
+	id = strtoul(arg, &endptr, 10);
+	if (!*arg || *endptr)
+		return NULL;
+	for (job = dmn->jobs; job; job = job->next)
+		if (job->id == id)
+			return job;
+	return NULL;
+}
+
+static void client_command(struct daemon *dmn, struct daemon_client *c, char *line)
+{
+	char status[DAEMON_LINE_MAX];
+	struct daemon_target *t;
+	struct daemon_job *job;
+	char *argv[5], *save;
+	int argc = 0;
+
+	/* No command takes more than four words, a fifth makes it fail. */
+	while (argc < 5 && (argv[argc] = strtok_r(argc ? NULL : line, " \t\r", &save)))
+		argc++;
+	if (!argc)
+		return;
+
+	if (!strcmp(argv[0], "flash")) {
+		submit_job(dmn, c, JOB_FLASH, argc, argv);
+	} else if (!strcmp(argv[0], "verify")) {
+		submit_job(dmn, c, JOB_VERIFY, argc, argv);
+	} else if (!strcmp(argv[0], "probe")) {
+		submit_job(dmn, c, JOB_PROBE, argc, argv);
+	} else if (!strcmp(argv[0], "status") || !strcmp(argv[0], "wait")) {
+		if (argc != 2 || !(job = find_job(dmn, argv[1]))) {
+			client_reply(c, "error no such job");
+		} else if (argv[0][0] == 'w' &&
+			   (job->state == JOB_QUEUED || job->state == JOB_RUNNING)) {
+			c->wait_id = job->id;
+		} else {
+			job_status(job, status, sizeof(status));
+			client_reply(c, "%s", status);
+		}
+	} else if (!strcmp(argv[0], "list") && argc == 1) {
+		for (job = dmn->jobs; job; job = job->next) {
+			job_status(job, status, sizeof(status));
+			client_reply(c, "%s", status);
+		}
+		client_reply(c, ".");
+	} else if (!strcmp(argv[0], "close") && argc == 2) {
+		t = find_target(dmn, argv[1]);
+		if (!t) {
+			client_reply(c, "error unknown target %s", argv[1]);
+		} else if (t->job) {
+			client_reply(c, "error %s is busy", argv[1]);
+		} else {
+			close_target(t);
+			client_reply(c, "ok");
+		}
+	} else {
+		client_reply(c, "error unknown command %s", argv[0]);
+	}
+}
+
+/* Run the complete lines a client sent, unless it waits for a job. */
+static void client_process(struct daemon *dmn, struct daemon_client *c)
+{
+	char line[DAEMON_LINE_MAX];
+	char *nl;
+	size_t len;
+
+	while (c->fd >= 0 && !c->wait_id && (nl = memchr(c->buf, '\n', c->len))) {
+		len = nl - c->buf;
+		memcpy(line, c->buf, len);
+		line[len] = '\0';
+		c->len -= len + 1;
+		memmove(c->buf, nl + 1, c->len);
+		client_command(dmn, c, line);
+	}
+	if (c->fd >= 0 && !c->wait_id && c->len == sizeof(c->buf)) {
+		client_reply(c, "error line too long");
+		close(c->fd);
+		c->fd = -1;
+	}
+}
+
+static void client_read(struct daemon *dmn, struct daemon_client *c)
+{
+	ssize_t n;
+
+	n = read(c->fd, c->buf + c->len, sizeof(c->buf) - c->len);
+	if (n < 0 && (errno == EAGAIN || errno == EINTR))
+		return;
+	if (n <= 0) {
+		close(c->fd);
+		c->fd = -1;
+		return;
+	}
+	c->len += n;
+	client_process(dmn, c);
+}
+
+static void client_accept(struct daemon *dmn)
+{
+	struct daemon_client *c;
+	int fd;
+
+	fd = accept(dmn->listen_fd, NULL, NULL);
+	if (fd < 0)
+		return;
+	fcntl(fd, F_SETFD, FD_CLOEXEC);
+	fcntl(fd, F_SETFL, O_NONBLOCK);
+	if (dmn->nclients == DAEMON_MAX_CLIENTS) {
+		send(fd, "error too many clients\n", 23, MSG_DONTWAIT | MSG_NOSIGNAL);
+		close(fd);
+		return;
+	}
+	c = &dmn->clients[dmn->nclients++];
+	c->fd = fd;
+	c->len = 0;
+	c->wait_id = 0;
+}
+
+/*
+ * Listen on path, readable and writable by the owner only. A socket file
+ * nobody listens on any more is replaced.
+ */
+static int daemon_listen(const char *path)
+{
+	struct sockaddr_un addr;
+	mode_t mask;
+	int fd, ret;
+
+	if (strlen(path) >= sizeof(addr.sun_path)) {
+		msg_perr("Error: socket path \"%s\" is too long.\n", path);
+		return -1;
+	}
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, path);
+
+	fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd < 0) {
+		msg_perr("Error: socket() failed: %s\n", strerror(errno));
+		return -1;
+	}
+	if (!connect(fd, (struct sockaddr *)&addr, sizeof(addr))) {
+		msg_perr("Error: a daemon already listens on %s.\n", path);
+		close(fd);
+		return -1;
+	}
+	if (errno == ECONNREFUSED)
+		unlink(path);
+	close(fd);
+
+	fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd < 0) {
+		msg_perr("Error: socket() failed: %s\n", strerror(errno));
+		return -1;
+	}
+	mask = umask(077);
+	ret = bind(fd, (struct sockaddr *)&addr, sizeof(addr));
+	umask(mask);
+	if (ret || listen(fd, 16)) {
+		msg_perr("Error: cannot listen on %s: %s\n", path, strerror(errno));
+		close(fd);
+		return -1;
+	}
+	fcntl(fd, F_SETFD, FD_CLOEXEC);
+	fcntl(fd, F_SETFL, O_NONBLOCK);
+	return fd;
+}
+
+/* Stop taking jobs and fail those that have not started. */
+static void daemon_stop(struct daemon *dmn)
+{
+	struct daemon_job *job;
+
+	msg_pinfo("Stopping, waiting for the running jobs.\n");
+	close(dmn->listen_fd);
+	dmn->listen_fd = -1;
+	unlink(dmn->socket_path);
+	for (job = dmn->jobs; job; job = job->next)
+		if (job->state == JOB_QUEUED)
+			job_fail(dmn, job, "daemon stopped");
+}
+
+/* Returns 0 once stopped and the running jobs are done, 1 when it gave up on them. */
+static int daemon_loop(struct daemon *dmn, int signal_fd)
+{
+	struct pollfd pfd[3 + DAEMON_MAX_CLIENTS];
+	struct signalfd_siginfo si;
+	unsigned int i, j, n;
+
+	while (1) {
+		schedule_jobs(dmn);
+		prune_jobs(dmn);
+		if (dmn->listen_fd < 0 && !jobs_running(dmn))
+			return 0;
+
+		pfd[0].fd = signal_fd;
+		pfd[0].events = POLLIN;
+		pfd[1].fd = dmn->done_pipe[0];
+		pfd[1].events = POLLIN;
+		pfd[2].fd = dmn->listen_fd;
+		pfd[2].events = POLLIN;
+		n = 3;
+		for (i = 0; i < dmn->nclients; i++, n++) {
+			pfd[n].fd = dmn->clients[i].fd;
+			/* A client with a full buffer is read again after its wait. */
+			pfd[n].events = dmn->clients[i].len < sizeof(dmn->clients[i].buf) ? POLLIN : 0;
+		}
+		if (poll(pfd, n, -1) < 0) {
+			if (errno == EINTR)
+				continue;
+			msg_perr("Error: poll() failed: %s\n", strerror(errno));
+			return 1;
+		}
+
+		if ((pfd[0].revents & POLLIN) && read(signal_fd, &si, sizeof(si)) == sizeof(si)) {
+			if (dmn->listen_fd < 0)
+				return 1;
+			daemon_stop(dmn);
+		}
+		if (pfd[1].revents & POLLIN)
+			jobs_done(dmn);
+		for (i = 0; i < dmn->nclients; i++)
+			if (pfd[3 + i].revents && dmn->clients[i].fd >= 0)
+				client_read(dmn, &dmn->clients[i]);
+		for (i = j = 0; i < dmn->nclients; i++)
+			if (dmn->clients[i].fd >= 0)
+				dmn->clients[j++] = dmn->clients[i];
+		dmn->nclients = j;
+		/* Last, so the compaction above does not shift a new client. */
+		if ((pfd[2].revents & POLLIN) && dmn->listen_fd >= 0)
+			client_accept(dmn);
+	}
+}
+
+/*
+ * Serve update jobs on socket_path until SIGTERM or SIGINT. Every BMC gets a
+ * context copied from tmpl, set up by init with "target_param=NAME,params".
+ * Returns 0 when stopped, 1 on errors.
+ */
+int bmc_daemon_main(const struct bmc_context *tmpl,
+		    int (*init)(struct bmc_context *ctx, const char *params),
+		    const char *target_param, const char *params, const char *socket_path,
+		    const char *erase_cache)
+{
+	struct daemon *dmn;
+	struct daemon_image *img;
+	struct daemon_job *job;
+	sigset_t mask, oldmask;
+	unsigned int i;
+	char *name;
+	int signal_fd, ret = 1;
+
+	dmn = calloc(1, sizeof(*dmn));
+	if (!dmn)
+		return 1;
+	dmn->tmpl = tmpl;
+	dmn->init = init;
+	dmn->target_param = target_param;
+	dmn->erase_cache = erase_cache;
+	dmn->socket_path = socket_path;
+	dmn->jobs_tail = &dmn->jobs;
+	while ((name = extract_programmer_param(target_param))) {
+		dmn->fixed_targets = true;
+		if (!find_target(dmn, name) && !add_target(dmn, name)) {
+			msg_perr("Error: at most %d BMCs can be served.\n", DAEMON_MAX_TARGETS);
+			free(name);
+			goto out;
+		}
+		free(name);
+	}
+	/* What extraction left of the parameters goes to every BMC. */
+	dmn->params = params ? params : "";
+
+	if (pipe(dmn->done_pipe)) {
+		msg_perr("Error: pipe() failed: %s\n", strerror(errno));
+		goto out;
+	}
+	fcntl(dmn->done_pipe[0], F_SETFL, O_NONBLOCK);
+	fcntl(dmn->done_pipe[0], F_SETFD, FD_CLOEXEC);
+	fcntl(dmn->done_pipe[1], F_SETFD, FD_CLOEXEC);
+	dmn->listen_fd = daemon_listen(socket_path);
+	if (dmn->listen_fd < 0)
+		goto out_pipe;
+
+	/* Job threads inherit the blocked signals, so only signal_fd sees them. */
+	sigemptyset(&mask);
+	sigaddset(&mask, SIGTERM);
+	sigaddset(&mask, SIGINT);
+	sigprocmask(SIG_BLOCK, &mask, &oldmask);
+	signal_fd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+	if (signal_fd < 0) {
+		msg_perr("Error: signalfd() failed: %s\n", strerror(errno));
+	} else {
+		for (i = 0; i < dmn->ntargets; i++)
+			if (open_target(dmn, dmn->targets[i]))
+				msg_pwarn("%s: cannot open it yet, will retry with its first job.\n",
+					  dmn->targets[i]->name);
+		msg_pinfo("Listening on %s.\n", socket_path);
+		ret = daemon_loop(dmn, signal_fd);
+		close(signal_fd);
+	}
+	if (dmn->listen_fd >= 0) {
+		close(dmn->listen_fd);
+		unlink(socket_path);
+	}
+	if (jobs_running(dmn)) {
+		/* An update cannot be stopped halfway; exiting ends its thread. */
+		msg_perr("Exiting with jobs running, their BMCs need another update.\n");
+		exit(1);
+	}
+	for (i = 0; i < dmn->nclients; i++)
+		close(dmn->clients[i].fd);
+	sigprocmask(SIG_SETMASK, &oldmask, NULL);
+out_pipe:
+	close(dmn->done_pipe[0]);
+	close(dmn->done_pipe[1]);
+out:
+	for (i = 0; i < dmn->ntargets; i++) {
+		close_target(dmn->targets[i]);
+		free(dmn->targets[i]->name);
+		free(dmn->targets[i]);
+	}
+	while ((job = dmn->jobs)) {
+		dmn->jobs = job->next;
+		free(job);
+	}
+	while ((img = dmn->images)) {
+		dmn->images = img->next;
+		free_image(img);
+	}
+	free(dmn);
+	return ret;
+}
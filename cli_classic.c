@@ -26,107 +26,365 @@
 #include <unistd.h>
 #include <errno.h>
 #include <getopt.h>
-#include <sys/ioctl.h>
-#include <linux/i2c-dev.h>
+#include <sys/syscall.h>
+#include <pthread.h>
 #include "flash.h"
+#include "bmc_update_lib.h"
+#if HAVE_ZLIB == 1
+#include <zlib.h>
+#endif
 
-static int i2cbmc_fd;
-static int i2cbmc_addr;
+/* Exit status when the BMC already runs the image and nothing was written. */
+#define EXIT_ALREADY_CURRENT	2
+
+enum {
+	OPTION_BASE = 0x0100,
+	OPTION_PREPARE,
+	OPTION_SIZE,
+	OPTION_DAEMON,
+	OPTION_MANIFEST,
+	OPTION_JOBS,
+};
+
+/* Length of an image read from stdin with -w -, 0 reads up to EOF. */
+static unsigned long stream_size;
+/* --jobs, the most updates a --manifest run has going at once. */
+static unsigned long manifest_jobs = 8;
 
 int programmer_init(const char *param);
 char *extract_programmer_param(const char *param_name);
 
-extern int32_t RunBMCUpdater (FILE* image);
+/* udelay.c */
+uint64_t internal_time_usecs(void);
 
-int32_t I2CSendData(uint8_t const *pui8Data, uint8_t ui8Size);
-int32_t I2CReceiveData(uint8_t *pui8Data, uint8_t ui8Size);
-void delay(uint32_t mills);
+/* bmcdaemon.c */
+int bmc_daemon_main(const struct bmc_context *ctx,
+		    int (*init)(struct bmc_context *ctx, const char *params),
+		    const char *target, const char *params, const char *socket_path,
+		    const char *erase_cache);
 
-/* udelay.c */
-void myusec_delay(unsigned int usecs);
-void myusec_calibrate_delay(void);
-void internal_sleep(unsigned int usecs);
-void internal_delay(unsigned int usecs);
+struct programmer_entry {
+	const char *name;
+	int (*init) (struct bmc_context *ctx, const char *params);
+	/* Parameter naming one BMC; given several times, they are all updated. */
+	const char *target;
+};
 
-/* Returns 0 upon success, a negative number upon errors. */
-int sema_bmc_update_main(
-		const char* filename, 
-		uint8_t read_it, 
-		uint8_t write_it, 
-		uint8_t erase_it, 
-		uint8_t verify_it )
+static const struct programmer_entry programmer_table[] = {
+	{ .name = "i2c",	.init = i2c_bmc_init,	.target = "dev" },
+	{ .name = "dummy",	.init = dummy_bmc_init,	.target = "image" },
+};
+
+/* Most BMCs one run updates. */
+#define MAX_TARGETS	32
+
+/* The i2c programmer stays the default so existing scripts keep working. */
+static const struct programmer_entry *programmer = &programmer_table[0];
+
+/* Parse a positive numeric parameter, leaving *value alone if it is absent. */
+static int bmc_numeric_param(const char *name, uint32_t *value)
 {
-	FILE *image;
+	char *arg = extract_programmer_param(name);
+	char *endptr;
+	unsigned long tmp;
 	int ret = 0;
 
-	if ((image = fopen(filename, "rb")) == NULL) {
-		msg_pwarn("Error: opening file \"%s\" failed: %s\n", filename, strerror(errno));
-		return -1;
+	if (!arg)
+		return 0;
+	tmp = strtoul(arg, &endptr, 0);
+	if (!strlen(arg) || *endptr || !tmp || tmp > UINT32_MAX) {
+		msg_perr("Error: %s must be a positive number.\n", name);
+		ret = -1;
+	} else {
+		*value = tmp;
 	}
+	free(arg);
+	return ret;
+}
 
-	// Get device, address from command-line
-	// Example: flashrom -p dev=/dev/device:address.
-	char *i2c_device = extract_programmer_param("dev");
-	msg_pwarn("Warn: %s\n",i2c_device );
-	if (i2c_device != NULL && strlen(i2c_device) > 0) {
-		char *i2c_address = strchr(i2c_device, ':');
-		if (i2c_address != NULL) {
-			*i2c_address = '\0';
-			i2c_address++;
-		}
-		if (i2c_address == NULL || strlen(i2c_address) == 0) {
-			msg_perr("Error: no address specified.\n"
-				 "Use flashrom -p i2c:dev=/dev/device:address.\n");
-			ret = -1;
-			goto out;
-		}
-		i2cbmc_addr = strtol(i2c_address, NULL, 16); // FIXME: error handling
-	} else {
-		msg_perr("Error: no device specified.\n"
-			 "Use flashrom -p i2c:dev=/dev/device:address.\n");
+/*
+ * Set the data block size from block=N. The engine refuses blocks below 4
+ * bytes, one flash word, so they are refused here already.
+ */
+static int bmc_block_param(struct bmc_context *ctx)
+{
+	char *arg = extract_programmer_param("block");
+	char *endptr;
+	unsigned long tmp;
+	int ret = 0;
+
+	if (!arg)
+		return 0;
+	tmp = strtoul(arg, &endptr, 0);
+	if (!strlen(arg) || *endptr || tmp < 4 || tmp > MAX_BLOCK_TRANSFER_SIZE) {
+		msg_perr("Error: block must be between 4 and %d.\n", MAX_BLOCK_TRANSFER_SIZE);
 		ret = -1;
-		goto out;
+	} else {
+		ctx->block_size = tmp;
 	}
-	msg_pinfo("Info: Will try to use device %s and address 0x%02x.\n", i2c_device, i2cbmc_addr);
+	free(arg);
+	return ret;
+}
 
-//	msg_pinfo("Info: Will %sreset the device at the end.\n", i2cbmc_doreset ? "" : "NOT ");
+/*
+ * Read an image from a pipe into memory and hand it over in an anonymous
+ * in-memory file, so the update can map it like a regular file. The input
+ * is only read sequentially: exactly size bytes into a buffer of that size,
+ * or up to EOF into a buffer that starts at hint bytes, if known, and grows
+ * if size is 0. With zlib, gzip
+ * compressed input is inflated on the way and size counts the inflated
+ * bytes. Nothing goes to disk, so without memfd_create() (Linux 3.17) the
+ * image is refused.
+ */
+static FILE *read_image_stream(FILE *in, unsigned long size, unsigned long hint)
+{
+	unsigned long total = 0, alloc;
+	unsigned char *buf, *tmp;
+	size_t want, got;
+	FILE *image = NULL;
+	int fd = -1, failed = 0;
+#if HAVE_ZLIB == 1
+	gzFile gz;
+	int n;
+#endif
 
-	// Open device
-	if ((i2cbmc_fd = open(i2c_device, O_RDWR)) < 0) {
-		switch (errno) {
-		case EACCES:
-			msg_perr("Error opening %s: Permission denied.\n"
-				 "Please use sudo or run as root.\n",
-				 i2c_device);
-			break;
-		case ENOENT:
-			msg_perr("Error opening %s: No such file.\n"
-				 "Please check you specified the correct device.\n",
-				 i2c_device);
-			break;
-		default:
-			msg_perr("Error opening %s: %s.\n", i2c_device, strerror(errno));
+#ifdef SYS_memfd_create
+	fd = syscall(SYS_memfd_create, "bmcflash-image", 0);
+#else
+	errno = ENOSYS;
+#endif
+	if (fd < 0 || !(image = fdopen(fd, "w+b"))) {
+		msg_perr("Error: cannot hold the image in memory: %s\n", strerror(errno));
+		if (fd >= 0)
+			close(fd);
+		return NULL;
+	}
+	if (size)
+		alloc = size;
+	else if (hint && hint < UINT32_MAX / 2)
+		alloc = hint + 1;	/* room to see EOF without growing */
+	else
+		alloc = 65536;
+	buf = malloc(alloc);
+	if (!buf) {
+		msg_perr("Error: cannot buffer the image: %s\n", strerror(errno));
+		fclose(image);
+		return NULL;
+	}
+#if HAVE_ZLIB == 1
+	/* gzread() passes input that is not gzip compressed through as it is. */
+	fd = dup(fileno(in));
+	gz = fd < 0 ? NULL : gzdopen(fd, "rb");
+	if (!gz) {
+		msg_perr("Error: cannot read the image: %s\n", strerror(errno));
+		if (fd >= 0)
+			close(fd);
+		free(buf);
+		fclose(image);
+		return NULL;
+	}
+	gzbuffer(gz, 65536);
+#endif
+
+	while (!size || total < size) {
+		if (total == alloc) {
+			if (alloc > UINT32_MAX / 2) {
+				msg_perr("Error: image is too large.\n");
+				failed = 2;
+				break;
+			}
+			tmp = realloc(buf, alloc * 2);
+			if (!tmp) {
+				msg_perr("Error: cannot buffer the image: %s\n", strerror(errno));
+				failed = 2;
+				break;
+			}
+			buf = tmp;
+			alloc *= 2;
 		}
-		ret = -1;
-		goto out;
+		want = alloc - total;
+		if (want > 1 << 30)
+			want = 1 << 30;
+#if HAVE_ZLIB == 1
+		n = gzread(gz, buf + total, want);
+		if (n < 0)
+			failed = 1;
+		got = n > 0 ? n : 0;
+#else
+		got = fread(buf + total, 1, want, in);
+		failed = ferror(in);
+#endif
+		if (!got)
+			break;
+		total += got;
+	}
+#if HAVE_ZLIB == 1
+	/* A truncated gzip stream only shows up as an error after the last read. */
+	if (!failed) {
+		gzerror(gz, &n);
+		if (n != Z_OK)
+			failed = 1;
+	}
+	if (failed == 1)
+		msg_perr("Error: cannot inflate the image: %s\n", gzerror(gz, &n));
+	gzclose(gz);
+#else
+	if (failed == 1)
+		msg_perr("Error: cannot read the image: %s\n", strerror(errno));
+#endif
+	if (!failed && (!total || (size && total != size))) {
+		if (size)
+			msg_perr("Error: read %lu bytes of the image, expected %lu.\n",
+				 total, size);
+		else
+			msg_perr("Error: the image is empty.\n");
+		failed = 2;
+	}
+	if (!failed && (fwrite(buf, 1, total, image) != total || fflush(image))) {
+		msg_perr("Error: cannot buffer the image: %s\n", strerror(errno));
+		failed = 2;
+	}
+	free(buf);
+	if (failed) {
+		fclose(image);
+		return NULL;
+	}
+	rewind(image);
+	return image;
+}
+
+/*
+ * Open the image to program. "-" is stdin, and gzip compressed files are
+ * inflated into memory as they are read.
+ */
+FILE *open_image(const char *filename)
+{
+	unsigned char magic[2];
+	FILE *file, *image;
+#if HAVE_ZLIB == 1
+	unsigned char isize[4];
+	unsigned long hint;
+#endif
+
+	if (!strcmp(filename, "-"))
+		return read_image_stream(stdin, stream_size, 0);
+
+	if ((file = fopen(filename, "rb")) == NULL) {
+		msg_perr("Error: opening file \"%s\" failed: %s\n", filename, strerror(errno));
+		return NULL;
+	}
+	if (fread(magic, 1, sizeof(magic), file) != sizeof(magic) ||
+	    magic[0] != 0x1f || magic[1] != 0x8b) {
+		rewind(file);
+		return file;
+	}
+#if HAVE_ZLIB == 1
+	/* The gzip trailer ends with the inflated size, modulo 4 GiB. */
+	hint = 0;
+	if (!fseek(file, -4, SEEK_END) && fread(isize, 1, sizeof(isize), file) == sizeof(isize))
+		hint = isize[0] | isize[1] << 8 | isize[2] << 16 | (unsigned long)isize[3] << 24;
+	rewind(file);
+	image = read_image_stream(file, 0, hint);
+#else
+	msg_perr("Error: \"%s\" is gzip compressed, but bmcflash was built without zlib.\n",
+		 filename);
+	image = NULL;
+#endif
+	fclose(file);
+	return image;
+}
+
+/*
+ * Another FILE on an image open_image() returned, for one update to take
+ * over, since RunBMCUpdater() closes its file. Concurrent updates map or
+ * pread() the image and leave the offset alone; the new FILE is still opened
+ * anew rather than dup()ed, so the read in full that stands in for a failed
+ * mapping has an offset of its own. Going through /proc works for in-memory
+ * images that have no path.
+ */
+FILE *reopen_image(FILE *image)
+{
+	char path[64];
+
+	snprintf(path, sizeof(path), "/proc/self/fd/%d", fileno(image));
+	return fopen(path, "rb");
+}
+
+/*
+ * Write filename.bmcpkt, the image with its SEND_DATA packets framed ahead of
+ * time for block=N. No programmer is touched.
+ */
+static int bmc_prepare_main(struct bmc_context *ctx, const char *filename)
+{
+	FILE *image, *packets;
+	char *outname;
+	int ret;
+
+	if (bmc_block_param(ctx))
+		return -1;
+
+	outname = malloc(strlen(filename) + sizeof(".bmcpkt"));
+	if (!outname)
+		return -1;
+	sprintf(outname, "%s.bmcpkt", filename);
+	if ((image = open_image(filename)) == NULL) {
+		free(outname);
+		return -1;
+	}
+	if ((packets = fopen(outname, "wb")) == NULL) {
+		msg_perr("Error: opening file \"%s\" failed: %s\n", outname, strerror(errno));
+		fclose(image);
+		free(outname);
+		return -1;
 	}
-	// Set slave address
-	if (ioctl(i2cbmc_fd, I2C_SLAVE, i2cbmc_addr) < 0) {
-		msg_perr("Error setting slave address 0x%02x: errno %d.\n",
-			 i2cbmc_addr, errno);
+	ret = PrepareBMCImage(ctx, image, packets);
+	fclose(image);
+	if (fclose(packets) && !ret) {
+		msg_perr("Error: writing \"%s\" failed: %s\n", outname, strerror(errno));
 		ret = -1;
-		goto out;
 	}
+	if (ret)
+		unlink(outname);
+	else
+		msg_pinfo("Wrote %s\n", outname);
+	free(outname);
+	return ret;
+}
 
-	{
-		uint8_t buffer[4];
-		int32_t status;
-		status = i2c_smbus_read_block_data(i2cbmc_fd, 0x28, buffer);
-		msg_pinfo("status is %x\n", status);
-		msg_pwarn("Buffer: %x-%x-%x-%x\n", buffer[0],buffer[1],buffer[2],buffer[3]);
-	}	
+/*
+ * Update one BMC on a context of its own, set up like tmpl. target, if not
+ * NULL, is handed to the programmer as its target parameter together with
+ * the parameters left in params. Closes image. Returns like
+ * sema_bmc_update_main().
+ */
+static int bmc_update_target(const struct bmc_context *tmpl, FILE *image, const char *target,
+			     const char *params, const char *erase_cache)
+{
+	struct bmc_context ctx = *tmpl;
+	char *param = NULL;
+	int ret;
 
-	RunBMCUpdater(image);
+	if (target) {
+		param = malloc(strlen(programmer->target) + strlen(target) +
+			       strlen(params ? params : "") + 3);
+		if (!param) {
+			fclose(image);
+			return -1;
+		}
+		sprintf(param, "%s=%s%s%s", programmer->target, target,
+			params && *params ? "," : "", params ? params : "");
+	}
+	if (programmer->init(&ctx, param ? param : params)) {
+		fclose(image);
+		free(param);
+		return -1;
+	}
+
+	if (erase_cache)
+		LoadEraseTiming(&ctx, erase_cache);
+	ret = RunBMCUpdater(&ctx, image);
+	if (erase_cache && !ret)
+		SaveEraseTiming(&ctx, erase_cache);
 	/*
 	int i = 700;
 	msg_pwarn("Time starts\n");
@@ -135,105 +393,539 @@ int sema_bmc_update_main(
 	msg_pwarn("Time ends\n");
 */
 
-	if (close(i2cbmc_fd) < 0) {
-		msg_perr("Error closing device: errno %d.\n", errno);
+	msg_pdbg("Polls while busy: %u command, %u erase, %u program, %u status, %u timeouts.\n",
+		 ctx.stats.polls[BMC_POLL_COMMAND], ctx.stats.polls[BMC_POLL_ERASE],
+		 ctx.stats.polls[BMC_POLL_PROGRAM], ctx.stats.polls[BMC_POLL_STATUS],
+		 ctx.stats.poll_timeouts);
+	print_delay_stats();
+	if (bmc_transport_shutdown(&ctx))
+		ret = -1;
+	free(param);
+	return ret;
+}
+
+/*
+ * Whether two targets share a bus. The bus is the part up to the first ':',
+ * e.g. /dev/i2c-3 of /dev/i2c-3:28. Device nodes are the same bus if they
+ * have the same device number, whatever their names, e.g. /dev/i2c-3 and a
+ * udev link to it. Anything else, like the image= files of the dummy
+ * programmer, is compared by name.
+ */
+int bmc_same_bus(const char *a, const char *b)
+{
+	size_t la = strcspn(a, ":"), lb = strcspn(b, ":");
+	char bus_a[256], bus_b[256];
+	struct stat st_a, st_b;
+
+	if (la < sizeof(bus_a) && lb < sizeof(bus_b)) {
+		memcpy(bus_a, a, la);
+		bus_a[la] = '\0';
+		memcpy(bus_b, b, lb);
+		bus_b[lb] = '\0';
+		if (!stat(bus_a, &st_a) && S_ISCHR(st_a.st_mode) &&
+		    !stat(bus_b, &st_b) && S_ISCHR(st_b.st_mode))
+			return st_a.st_rdev == st_b.st_rdev;
+	}
+	return la == lb && !strncmp(a, b, la);
+}
+
+/* The BMCs on one bus, for bmc_update_parallel(). */
+struct bmc_bus {
+	pthread_t thread;
+	const struct bmc_context *tmpl;
+	FILE *image;
+	char **targets;
+	int first, ntargets;
+	const char *params, *erase_cache;
+	int updated, failed;
+};
+
+/* Update every target on the bus of targets[first] in turn. */
+static void *bmc_bus_thread(void *arg)
+{
+	struct bmc_bus *bus = arg;
+	int j, ret;
+	FILE *f;
+
+	for (j = bus->first; j < bus->ntargets; j++) {
+		if (!bmc_same_bus(bus->targets[bus->first], bus->targets[j]))
+			continue;
+		f = reopen_image(bus->image);
+		if (!f) {
+			msg_perr("%s: cannot open the image: %s\n", bus->targets[j], strerror(errno));
+			bus->failed = 1;
+			continue;
+		}
+		ret = bmc_update_target(bus->tmpl, f, bus->targets[j], bus->params,
+					bus->erase_cache);
+		if (ret == 0)
+			bus->updated = 1;
+		else if (ret != BMC_UPDATE_CURRENT)
+			bus->failed = 1;
+		msg_pinfo("%s: %s\n", bus->targets[j], ret == 0 ? "updated" :
+			  ret == BMC_UPDATE_CURRENT ? "already current" : "FAILED");
+	}
+	return NULL;
+}
+
+/*
+ * Update several BMCs. Every bus gets a thread of its own, and every update
+ * a context of its own, while the BMCs on one bus are updated one after the
+ * other. Returns 0 if all went well and at least one was updated,
+ * BMC_UPDATE_CURRENT if none needed it, -1 if any failed.
+ */
+static int bmc_update_parallel(struct bmc_context *ctx, FILE *image, char **targets,
+			       int ntargets, const char *params, const char *erase_cache)
+{
+	struct bmc_context tmpl = *ctx;
+	struct bmc_bus buses[MAX_TARGETS];
+	int i, j, nbus = 0, ret, updated = 0, failed = 0;
+
+	/* The byte counters of several buses would garble each other. */
+	tmpl.show_progress = false;
+
+	for (i = 0; i < ntargets; i++) {
+		for (j = 0; j < i; j++)
+			if (bmc_same_bus(targets[i], targets[j]))
+				break;
+		if (j < i)
+			continue;
+
+		memset(&buses[nbus], 0, sizeof(buses[nbus]));
+		buses[nbus].tmpl = &tmpl;
+		buses[nbus].image = image;
+		buses[nbus].targets = targets;
+		buses[nbus].first = i;
+		buses[nbus].ntargets = ntargets;
+		buses[nbus].params = params;
+		buses[nbus].erase_cache = erase_cache;
+		ret = pthread_create(&buses[nbus].thread, NULL, bmc_bus_thread, &buses[nbus]);
+		if (ret) {
+			msg_perr("Error: cannot start the update of %s: %s\n",
+				 targets[i], strerror(ret));
+			failed = 1;
+			break;
+		}
+		nbus++;
+	}
+
+	for (i = 0; i < nbus; i++) {
+		pthread_join(buses[i].thread, NULL);
+		updated |= buses[i].updated;
+		failed |= buses[i].failed;
+	}
+	fclose(image);
+	if (failed)
 		return -1;
+	return updated ? 0 : BMC_UPDATE_CURRENT;
+}
+
+/*
+ * Apply the protocol tunables among the programmer parameters to ctx and
+ * find the erase time file, which the caller frees. Returns 0 on success.
+ */
+static int bmc_setup(struct bmc_context *ctx, char **erase_cache_path)
+{
+	char *framing, *status, *endptr, *erase_cache, *arg;
+	uint32_t poll_us = 0, timeout_ms = 0, erase_timeout_ms = 0;
+	int i, ret = 0;
+
+	// framing=legacy sends size, checksum and data as separate bus writes.
+	framing = extract_programmer_param("framing");
+	if (framing) {
+		if (!strcmp(framing, "legacy")) {
+			ctx->legacy_framing = true;
+		} else if (strcmp(framing, "single")) {
+			msg_perr("Error: framing must be \"single\" or \"legacy\".\n");
+			ret = -1;
+		}
+		free(framing);
+		if (ret)
+			return ret;
 	}
-out:
-	free(i2c_device);
-	return ret;
+
+	// block=N overrides the negotiated data block size.
+	if (bmc_block_param(ctx))
+		return -1;
+
+	// status=N asks for the boot loader status every N data blocks.
+	status = extract_programmer_param("status");
+	if (status) {
+		ctx->status_interval = strtoul(status, &endptr, 0);
+		if (!strlen(status) || *endptr || !ctx->status_interval) {
+			msg_perr("Error: status must be a positive number of blocks.\n");
+			ret = -1;
+		}
+		free(status);
+		if (ret)
+			return ret;
+	}
+
+	// poll_us=N is the first retry interval while the boot loader is busy,
+	// timeout_ms=N and erase_timeout_ms=N bound how long it may stay busy.
+	if (bmc_numeric_param("poll_us", &poll_us) ||
+	    bmc_numeric_param("timeout_ms", &timeout_ms) ||
+	    bmc_numeric_param("erase_timeout_ms", &erase_timeout_ms))
+		return -1;
+	for (i = 0; i < BMC_POLL_TYPES; i++) {
+		if (poll_us) {
+			ctx->poll_policy[i].initial_us = poll_us;
+			if (ctx->poll_policy[i].max_us < poll_us)
+				ctx->poll_policy[i].max_us = poll_us;
+		}
+		if (i == BMC_POLL_ERASE) {
+			if (erase_timeout_ms)
+				ctx->poll_policy[i].deadline_ms = erase_timeout_ms;
+		} else if (timeout_ms) {
+			ctx->poll_policy[i].deadline_ms = timeout_ms;
+		}
+	}
+
+	// image_cache=DIR keeps every image framed once, for all updates to share.
+	arg = extract_programmer_param("image_cache");
+	if (arg && !strlen(arg)) {
+		free(arg);
+		arg = NULL;
+	}
+	ctx->image_cache = arg;
+
+	// erase_cache=FILE keeps the learned flash erase time of each BMC, an
+	// empty value disables it.
+	erase_cache = extract_programmer_param("erase_cache");
+	if (!erase_cache && getenv("HOME")) {
+		erase_cache = malloc(strlen(getenv("HOME")) + sizeof("/.bmcflash_erase"));
+		if (erase_cache)
+			sprintf(erase_cache, "%s/.bmcflash_erase", getenv("HOME"));
+	}
+	if (erase_cache && !strlen(erase_cache)) {
+		free(erase_cache);
+		erase_cache = NULL;
+	}
+	*erase_cache_path = erase_cache;
+	return 0;
 }
 
 /*
-  __s32 i2c_smbus_read_block_data(int file, __u8 command, __u8 *values);
-  __s32 i2c_smbus_write_block_data(int file, __u8 command, __u8 length,  __u8 *values);
-*/
-int32_t
-I2CSendData(uint8_t const *pui8Data, uint8_t ui8Size)
+ * Returns 0 upon success, BMC_UPDATE_CURRENT if the BMC already runs the
+ * image, a negative number upon errors.
+ */
+int sema_bmc_update_main(
+		struct bmc_context *ctx,
+		const char* filename, 
+		char *params,
+		uint8_t read_it, 
+		uint8_t write_it, 
+		uint8_t erase_it, 
+		uint8_t verify_it )
 {
-    int32_t status;
+	FILE *image;
+	char *endptr, *erase_cache;
+	char *targets[MAX_TARGETS];
+	int i, ntargets = 0, ret = 0;
 
-	status = i2c_smbus_write_block_data(i2cbmc_fd, 0x21, ui8Size, pui8Data);
-    if(status>=0)  // Bytes send
-    {
-      return(0);
-    }
+	if ((image = open_image(filename)) == NULL)
+		return -1;
+	if (bmc_setup(ctx, &erase_cache)) {
+		fclose(image);
+		return -1;
+	}
 
-    return(-1);
+	// Several dev= (or image= for dummy) parameters update several BMCs.
+	while (ntargets < MAX_TARGETS &&
+	       (targets[ntargets] = extract_programmer_param(programmer->target)))
+		ntargets++;
+	if (ntargets == MAX_TARGETS && (endptr = extract_programmer_param(programmer->target))) {
+		msg_perr("Error: at most %d BMCs can be updated at once.\n", MAX_TARGETS);
+		free(endptr);
+		ret = -1;
+	}
+
+	if (ret) {
+		fclose(image);
+	} else if (ntargets > 1) {
+		ret = bmc_update_parallel(ctx, image, targets, ntargets, params, erase_cache);
+	} else if (ntargets == 1) {
+		ret = bmc_update_target(ctx, image, targets[0], params, erase_cache);
+	} else {
+		ret = bmc_update_target(ctx, image, NULL, params, erase_cache);
+	}
+	for (i = 0; i < ntargets; i++)
+		free(targets[i]);
+	free(erase_cache);
+	return ret;
 }
 
-//*****************************************************************************
-//
-//! I2CReceiveData() receives data over a UART port.
-//!
-//! \param pui8Data is the buffer to read data into from the UART port.
-//! \param ui8Size is the number of bytes provided in pui8Data buffer that should
-//!     be written with data from the UART port.
-//!
-//! This function reads back ui8Size bytes of data from the UART port, that was
-//! opened by a call to initI2C(), into the buffer that is pointed to by
-//! pui8Data.
-//!
-//! \return This function returns zero to indicate success while any non-zero
-//!     value indicates a failure.
-//
-//*****************************************************************************
-int32_t
-I2CReceiveData(uint8_t *pui8Data, uint8_t ui8Size)
+/* One line of a --manifest file. */
+struct manifest_entry {
+	char *target;		/* BUS:ADDRESS, as dev= takes it */
+	char *image;
+	unsigned int line;
+	/* Entry holding the open image, the first one naming the same file. */
+	unsigned int file;
+	FILE *f;
+	enum { ENTRY_PENDING, ENTRY_RUNNING, ENTRY_DONE } state;
+	pthread_t thread;
+	struct manifest_shared *run;
+	/* Set by the thread once the update is over, under run->lock. */
+	int ended;
+	/* Once done, as sema_bmc_update_main() returns. */
+	int result;
+	uint64_t start_us, time_us;
+};
+
+/*
+ * Read a manifest: one BMC per line as BUS ADDRESS IMAGE, blank lines and
+ * lines starting with '#' are skipped. Returns the number of entries, or -1.
+ */
+static int read_manifest(const char *filename, struct manifest_entry **entries)
 {
-	int32_t status;
-	uint8_t smbusBuffer[32];
-	status = i2c_smbus_read_block_data(i2cbmc_fd, 0xFF, smbusBuffer);
-	if(status < 0)
-		return (-1);
-	else {
-		uint8_t i;
-		for(i=0;i<status;i++){
-			pui8Data[i] = smbusBuffer[i];
+	struct manifest_entry *e = NULL, *tmp;
+	char *line = NULL, *bus, *address, *image, *save;
+	unsigned int lineno = 0;
+	int n = 0, ret = -1;
+	size_t size = 0;
+	FILE *f;
+
+	f = strcmp(filename, "-") ? fopen(filename, "r") : stdin;
+	if (!f) {
+		msg_perr("Error: opening file \"%s\" failed: %s\n", filename, strerror(errno));
+		return -1;
+	}
+	while (getline(&line, &size, f) > 0) {
+		lineno++;
+		bus = strtok_r(line, " \t\r\n", &save);
+		if (!bus || *bus == '#')
+			continue;
+		address = strtok_r(NULL, " \t\r\n", &save);
+		image = strtok_r(NULL, " \t\r\n", &save);
+		if (!image || strtok_r(NULL, " \t\r\n", &save) || strchr(bus, ':') ||
+		    strchr(bus, ',') || strchr(address, ',')) {
+			msg_perr("Error: %s:%u: expected BUS ADDRESS IMAGE.\n", filename, lineno);
+			goto out;
+		}
+		tmp = realloc(e, (n + 1) * sizeof(*e));
+		if (!tmp)
+			goto out;
+		e = tmp;
+		memset(&e[n], 0, sizeof(e[n]));
+		e[n].line = lineno;
+		e[n].target = malloc(strlen(bus) + strlen(address) + 2);
+		e[n].image = strdup(image);
+		n++;
+		if (!e[n - 1].target || !e[n - 1].image)
+			goto out;
+		sprintf(e[n - 1].target, "%s:%s", bus, address);
+	}
+	if (!n)
+		msg_perr("Error: %s lists no BMC.\n", filename);
+	else
+		ret = n;
+out:
+	free(line);
+	if (f != stdin)
+		fclose(f);
+	if (ret < 0) {
+		while (n--) {
+			free(e[n].target);
+			free(e[n].image);
 		}
+		free(e);
+		e = NULL;
 	}
-    return(0);
+	*entries = e;
+	return ret;
+}
+
+/* Whether an update runs on the bus of e[i]. */
+static int manifest_bus_busy(const struct manifest_entry *e, int n, int i)
+{
+	int j;
+
+	for (j = 0; j < n; j++)
+		if (e[j].state == ENTRY_RUNNING && bmc_same_bus(e[j].target, e[i].target))
+			return 1;
+	return 0;
+}
+
+static const char *manifest_result(int result)
+{
+	return result == 0 ? "updated" : result == BMC_UPDATE_CURRENT ? "already current" : "FAILED";
 }
 
+/* What manifest_run() shares with the threads of its entries. */
+struct manifest_shared {
+	const struct bmc_context *tmpl;
+	struct manifest_entry *e;
+	const char *params, *erase_cache;
+	pthread_mutex_t lock;
+	pthread_cond_t ended;
+};
 
-void delay(uint32_t mills) 
+static void *manifest_thread(void *arg)
 {
-	internal_delay(mills*1000);
+	struct manifest_entry *e = arg;
+	struct manifest_shared *run = e->run;
+	FILE *f;
+	int ret = -1;
+
+	f = reopen_image(run->e[e->file].f);
+	if (f)
+		ret = bmc_update_target(run->tmpl, f, e->target, run->params, run->erase_cache);
+	else
+		msg_perr("%s: cannot open the image: %s\n", e->target, strerror(errno));
+
+	pthread_mutex_lock(&run->lock);
+	e->result = ret;
+	e->ended = 1;
+	pthread_cond_signal(&run->ended);
+	pthread_mutex_unlock(&run->lock);
+	return NULL;
 }
-//****************************************************************************
-//
-//! EnterBootloader() sends a command to the serial boot loader.
-//!
-//! \param pui8Command is the unformatted command to send to the device.
-//! \param ui8Size is the size, in bytes, of the command to be sent.
-//!
-//! This function will send a command to the device and read back the status
-//! code from the device to see if the command completed successfully.
-//!
-//! \return If any part of the function fails, the function will return a
-//!     negative error code.  The function will return 0 to indicate success.
-//
-//****************************************************************************
-int32_t
-I2CEnterBootloader(uint8_t *pui8Command, uint8_t ui8Size)
+
+/*
+ * Run the entries of a manifest, each on a thread and a context of its own.
+ * At most manifest_jobs run at a time and at most one per bus; whenever one
+ * ends, the first pending entry on an idle bus takes its place.
+ */
+static void manifest_run(struct bmc_context *ctx, struct manifest_entry *e, int n,
+			 const char *params, const char *erase_cache)
 {
-    int32_t Status;
-    
-    if(ui8Size==1) {
-		Status = i2c_smbus_write_block_data(i2cbmc_fd, pui8Command[0], 0, NULL);
-    } else {
-    	Status = i2c_smbus_write_block_data(i2cbmc_fd, pui8Command[0], ui8Size--, &pui8Command[1]);
-    }
-
-	if(Status<0)  //
-    {
-        msg_pinfo("Failed to send ENTER_BOOTLOADER command\n");
-        return(-1);
-    }
-    delay(400); // wait for Application exit & Bootloader start
-
-    return(0);
+	struct bmc_context tmpl = *ctx;
+	struct manifest_shared run = {
+		.tmpl = &tmpl, .e = e, .params = params, .erase_cache = erase_cache,
+		.lock = PTHREAD_MUTEX_INITIALIZER, .ended = PTHREAD_COND_INITIALIZER,
+	};
+	unsigned int running = 0;
+	int i, done = 0, ret;
+
+	/* The byte counters of several updates would garble each other. */
+	tmpl.show_progress = false;
+
+	pthread_mutex_lock(&run.lock);
+	while (done < n) {
+		for (i = 0; i < n && running < manifest_jobs; i++) {
+			if (e[i].state != ENTRY_PENDING || manifest_bus_busy(e, n, i))
+				continue;
+			e[i].start_us = internal_time_usecs();
+			e[i].run = &run;
+			ret = pthread_create(&e[i].thread, NULL, manifest_thread, &e[i]);
+			if (ret) {
+				msg_perr("Error: cannot start the update of %s: %s\n",
+					 e[i].target, strerror(ret));
+				e[i].state = ENTRY_DONE;
+				e[i].result = -1;
+				done++;
+				continue;
+			}
+			e[i].state = ENTRY_RUNNING;
+			running++;
+		}
+		if (!running)
+			continue;
+
+		for (;;) {
+			for (i = 0; i < n; i++)
+				if (e[i].state == ENTRY_RUNNING && e[i].ended)
+					break;
+			if (i < n)
+				break;
+			pthread_cond_wait(&run.ended, &run.lock);
+		}
+		pthread_join(e[i].thread, NULL);
+		e[i].state = ENTRY_DONE;
+		e[i].time_us = internal_time_usecs() - e[i].start_us;
+		running--;
+		done++;
+		msg_pinfo("%s: %s (%u/%d)\n", e[i].target, manifest_result(e[i].result), done, n);
+	}
+	pthread_mutex_unlock(&run.lock);
 }
+
+/*
+ * Update every BMC a manifest lists. Returns 0 if all went well and at least
+ * one was updated, BMC_UPDATE_CURRENT if none needed it, -1 if any failed.
+ */
+static int bmc_manifest_main(struct bmc_context *ctx, const char *filename, char *params)
+{
+	struct manifest_entry *e;
+	char *erase_cache, *arg;
+	int i, j, n, width = 0, updated = 0, current = 0, failed = 0;
+
+	if ((arg = extract_programmer_param(programmer->target))) {
+		msg_perr("Error: %s= does not go with --manifest, the manifest names the BMCs.\n",
+			 programmer->target);
+		free(arg);
+		return -1;
+	}
+	if (bmc_setup(ctx, &erase_cache))
+		return -1;
+	n = read_manifest(filename, &e);
+	if (n < 0) {
+		free(erase_cache);
+		return -1;
+	}
+
+	/* Open every image up front, each file once, so a typo fails before any update. */
+	for (i = 0; i < n; i++) {
+		for (j = 0; j < i; j++)
+			if (!strcmp(e[i].image, e[j].image))
+				break;
+		e[i].file = j;
+		if (j < i)
+			continue;
+		if (!strcmp(e[i].image, "-")) {
+			msg_perr("Error: %s:%u: images cannot come from stdin.\n", filename, e[i].line);
+			failed = 1;
+			break;
+		}
+		if (!(e[i].f = open_image(e[i].image))) {
+			failed = 1;
+			break;
+		}
+	}
+	for (i = 0; i < n && !failed; i++)
+		for (j = 0; j < i; j++)
+			if (!strcmp(e[i].target, e[j].target)) {
+				msg_perr("Error: %s:%u: %s is listed twice.\n", filename,
+					 e[i].line, e[i].target);
+				failed = 1;
+				break;
+			}
+	if (!failed) {
+		manifest_run(ctx, e, n, params, erase_cache);
+
+		for (i = 0; i < n; i++)
+			if ((int)strlen(e[i].target) > width)
+				width = strlen(e[i].target);
+		msg_pinfo("\nSummary:\n");
+		for (i = 0; i < n; i++) {
+			if (e[i].state != ENTRY_DONE)
+				e[i].result = -1;
+			msg_pinfo("  %-*s  %-15s %6.1f s  %s\n", width, e[i].target,
+				  manifest_result(e[i].result), e[i].time_us / 1e6, e[i].image);
+			if (e[i].result == 0)
+				updated++;
+			else if (e[i].result == BMC_UPDATE_CURRENT)
+				current++;
+			else
+				failed++;
+		}
+		msg_pinfo("%d updated, %d already current, %d failed.\n", updated, current, failed);
+	}
+
+	for (i = 0; i < n; i++) {
+		if (e[i].f)
+			fclose(e[i].f);
+		free(e[i].target);
+		free(e[i].image);
+	}
+	free(e);
+	free(erase_cache);
+	if (failed)
+		return -1;
+	return updated ? 0 : BMC_UPDATE_CURRENT;
+}
+
 static void cli_classic_abort_usage(void)
 {
 	msg_pinfo("Please run \"flashrom --help\" for usage info.\n");
@@ -247,7 +939,7 @@ static int check_filename(char *filename, char *type)
 		return 1;
 	}
 	/* Not an error, but maybe the user intended to specify a CLI option instead of a file name. */
-	if (filename[0] == '-')
+	if (filename[0] == '-' && filename[1])
 		fprintf(stderr, "Warning: Supplied %s file name starts with -\n", type);
 	return 0;
 }
@@ -256,11 +948,14 @@ int main(int argc, char *argv[])
 {
 	const char *name;
 	int namelen;
+	unsigned int prog;
 	int opt;
 	int operation_specified = 0, option_index = 0;
-	int read_it = 0, erase_it = 0,write_it = 0, verify_it = 0;
+	int read_it = 0, erase_it = 0,write_it = 0, verify_it = 0, prepare_it = 0;
 	int dont_verify_it = 0;
+	int jobs_given = 0;
 	int ret = 0;
+	char *endptr;
 
 	static const char optstring[] = "r:Rw:v:nVEfc:l:i:p:Lzho:";
 	static const struct option long_options[] = {
@@ -269,12 +964,18 @@ int main(int argc, char *argv[])
 		{"erase",		0, NULL, 'E'},
 		{"verify",		1, NULL, 'v'},
 		{"programmer",		1, NULL, 'p'},
+		{"verbose",		0, NULL, 'V'},
+		{"base",		1, NULL, OPTION_BASE},
+		{"force",		0, NULL, 'f'},
+		{"prepare",		1, NULL, OPTION_PREPARE},
+		{"size",		1, NULL, OPTION_SIZE},
+		{"daemon",		1, NULL, OPTION_DAEMON},
+		{"manifest",		1, NULL, OPTION_MANIFEST},
+		{"jobs",		1, NULL, OPTION_JOBS},
 		{NULL,			0, NULL, 0},
 		/*
 		{"noverify",		0, NULL, 'n'},
 		{"chip",		1, NULL, 'c'},
-		{"verbose",		0, NULL, 'V'},
-		{"force",		0, NULL, 'f'},
 		{"layout",		1, NULL, 'l'},
 		{"image",		1, NULL, 'i'},
 		{"list-supported",	0, NULL, 'L'},
@@ -287,10 +988,16 @@ int main(int argc, char *argv[])
 	};
 
 	char *filename = NULL;
+	char *basefile = NULL;
+	char *socketfile = NULL;
+	char *manifestfile = NULL;
+	char *erase_cache = NULL;
 	char *layoutfile = NULL;
 	char *pparam = NULL;
+	struct bmc_context bmc;
 
 	setbuf(stdout, NULL);
+	bmc_context_init(&bmc);
 	/* FIXME: Delay all operation_specified checks until after command
 	 * line parsing to allow --help overriding everything else.
 	 */
@@ -330,8 +1037,8 @@ int main(int argc, char *argv[])
 			verify_it = 1;
 			break;
 		case 'p':
-			//for (prog = 0; prog < PROGRAMMER_INVALID; prog++) {
-				name = "i2c";
+			for (prog = 0; prog < ARRAY_SIZE(programmer_table); prog++) {
+				name = programmer_table[prog].name;
 				namelen = strlen(name);
 				if (strncmp(optarg, name, namelen) == 0) {
 					switch (optarg[namelen]) {
@@ -354,8 +1061,66 @@ int main(int argc, char *argv[])
 					}
 					break;
 				}
-			//}
-			break;	
+			}
+			if (prog == ARRAY_SIZE(programmer_table)) {
+				fprintf(stderr, "Error: Unknown programmer \"%s\".\n", optarg);
+				cli_classic_abort_usage();
+			}
+			programmer = &programmer_table[prog];
+			break;
+		case 'V':
+			verbose_screen++;
+			break;
+		case 'f':
+			bmc.force_update = true;
+			break;
+		case OPTION_PREPARE:
+			if (++operation_specified > 1) {
+				fprintf(stderr, "More than one operation "
+					"specified. Aborting.\n");
+				cli_classic_abort_usage();
+			}
+			filename = strdup(optarg);
+			prepare_it = 1;
+			break;
+		case OPTION_DAEMON:
+			if (++operation_specified > 1) {
+				fprintf(stderr, "More than one operation "
+					"specified. Aborting.\n");
+				cli_classic_abort_usage();
+			}
+			socketfile = strdup(optarg);
+			break;
+		case OPTION_MANIFEST:
+			if (++operation_specified > 1) {
+				fprintf(stderr, "More than one operation "
+					"specified. Aborting.\n");
+				cli_classic_abort_usage();
+			}
+			manifestfile = strdup(optarg);
+			break;
+		case OPTION_JOBS:
+			manifest_jobs = strtoul(optarg, &endptr, 0);
+			if (!strlen(optarg) || *endptr || !manifest_jobs || manifest_jobs > UINT32_MAX) {
+				fprintf(stderr, "Error: --jobs must be a positive number.\n");
+				cli_classic_abort_usage();
+			}
+			jobs_given = 1;
+			break;
+		case OPTION_SIZE:
+			stream_size = strtoul(optarg, &endptr, 0);
+			if (!strlen(optarg) || *endptr || !stream_size || stream_size > UINT32_MAX) {
+				fprintf(stderr, "Error: --size must be a positive number of bytes.\n");
+				cli_classic_abort_usage();
+			}
+			break;
+		case OPTION_BASE:
+			if (basefile) {
+				fprintf(stderr, "Error: --base specified more than once. Aborting.\n");
+				cli_classic_abort_usage();
+			}
+			basefile = strdup(optarg);
+			break;
 		default:
 			cli_classic_abort_usage();
 			break;
@@ -366,7 +1131,36 @@ int main(int argc, char *argv[])
 		cli_classic_abort_usage();
 	}
 
-	if ((read_it | write_it | verify_it) && check_filename(filename, "image")) {
+	if ((read_it | write_it | verify_it | prepare_it) && check_filename(filename, "image")) {
+		cli_classic_abort_usage();
+	}
+	if (stream_size && !(write_it && !strcmp(filename, "-"))) {
+		fprintf(stderr, "Error: --size only applies to -w -.\n");
+		cli_classic_abort_usage();
+	}
+	if (prepare_it && !strcmp(filename, "-")) {
+		fprintf(stderr, "Error: --prepare needs an image file, not stdin.\n");
+		cli_classic_abort_usage();
+	}
+	if (basefile && check_filename(basefile, "base image")) {
+		cli_classic_abort_usage();
+	}
+	if (socketfile && check_filename(socketfile, "socket")) {
+		cli_classic_abort_usage();
+	}
+	if (socketfile && basefile) {
+		fprintf(stderr, "Error: --base does not apply to --daemon.\n");
+		cli_classic_abort_usage();
+	}
+	if (manifestfile && check_filename(manifestfile, "manifest")) {
+		cli_classic_abort_usage();
+	}
+	if (manifestfile && basefile) {
+		fprintf(stderr, "Error: --base does not apply to --manifest.\n");
+		cli_classic_abort_usage();
+	}
+	if (jobs_given && !manifestfile) {
+		fprintf(stderr, "Error: --jobs only applies to --manifest.\n");
 		cli_classic_abort_usage();
 	}
 	if (programmer_init(pparam)) {
@@ -374,12 +1168,57 @@ int main(int argc, char *argv[])
 		ret = 1;
 		goto out_shutdown;
 	}
-	myusec_calibrate_delay();
-
+	if (prepare_it) {
+		ret = bmc_prepare_main(&bmc, filename) ? 1 : 0;
+		goto out_shutdown;
+	}
+	if (socketfile) {
+		if (bmc_setup(&bmc, &erase_cache))
+			ret = 1;
+		else
+			ret = bmc_daemon_main(&bmc, programmer->init, programmer->target, pparam,
+					      socketfile, erase_cache);
+		goto out_shutdown;
+	}
+	if (manifestfile) {
+		switch (bmc_manifest_main(&bmc, manifestfile, pparam)) {
+		case 0:
+			break;
+		case BMC_UPDATE_CURRENT:
+			ret = EXIT_ALREADY_CURRENT;
+			break;
+		default:
+			ret = 1;
+			break;
+		}
+		goto out_shutdown;
+	}
+	/* The flash is assumed to hold this image, only changed pages are rewritten. */
+	if (basefile && !(bmc.base_file = fopen(basefile, "rb"))) {
+		msg_perr("Error: opening file \"%s\" failed: %s\n", basefile, strerror(errno));
+		ret = 1;
+		goto out_shutdown;
+	}
 	erase_it = 0;
-	sema_bmc_update_main(filename, read_it, write_it, erase_it, verify_it);
+	switch (sema_bmc_update_main(&bmc, filename, pparam, read_it, write_it, erase_it, verify_it)) {
+	case 0:
+		break;
+	case BMC_UPDATE_CURRENT:
+		ret = EXIT_ALREADY_CURRENT;
+		break;
+	default:
+		ret = 1;
+		break;
+	}
+	if (bmc.base_file)
+		fclose(bmc.base_file);
 out_shutdown:
 	free(filename);
+	free(basefile);
+	free(socketfile);
+	free(manifestfile);
+	free((char *)bmc.image_cache);
+	free(erase_cache);
 	free(layoutfile);
 	free(pparam);
 
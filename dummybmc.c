@@ -0,0 +1,560 @@
+/*
+ * This file is part of the flashrom project.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; version 2 of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+/*
+ * Software stand-in for a SEMA BMC running the TivaC serial boot loader.
+ *
+ * The emulator speaks the same byte stream the i2c transport puts on the bus:
+ * every block write is appended to the boot loader's receive stream and every
+ * block read pops one queued response chunk (or a single zero byte while the
+ * device has nothing to say). Bus transfer time and flash erase/program time
+ * are modelled against CLOCK_MONOTONIC so that the host side sees the same
+ * waits it would see on a real board.
+ *
+ * Parameters (all optional):
+ *   bus_khz=N    SMBus clock used to compute transfer time, 0 disables it
+ *   xfer_us=N    fixed adapter overhead per bus transaction
+ *   erase_us=N   erase time per 1 KiB flash page
+ *   program_us=N program time per 32-bit flash word
+ *   boot_ms=N    time the application needs to restart into the boot loader
+ *   maxblock=N   largest block the adapter can move in one transaction,
+ *                default 32 (255 with mode=rdwr)
+ *   maxpacket=N  largest packet payload the boot loader buffers, default 80
+ *   legacy=yes   only accept the packet size and checksum as one byte writes
+ *   fault=N      fail programming of the Nth SEND_DATA packet once
+ *   image=FILE   flash contents, loaded at init and written back at shutdown
+ *   mode=rdwr    offer combined write-then-read transactions like I2C_RDWR
+ *   version=STR  version block the application reports, none by default
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include "flash.h"
+#include "bmc_update_lib.h"
+
+/* udelay.c */
+void internal_sleep(unsigned int usecs);
+uint64_t internal_time_usecs(void);
+
+#define DUMMY_BMC_FLASH_SIZE	(256 * 1024)	/* TM4C123 */
+#define DUMMY_BMC_PAGE_SIZE	0x400
+#define DUMMY_BMC_QUEUE_LEN	8
+
+enum dummy_bmc_mode {
+	DUMMY_BMC_APPLICATION,
+	DUMMY_BMC_BOOTING,
+	DUMMY_BMC_BOOTLOADER,
+};
+
+enum dummy_bmc_rx {
+	DUMMY_BMC_RX_SIZE,
+	DUMMY_BMC_RX_CHECKSUM,
+	DUMMY_BMC_RX_DATA,
+	DUMMY_BMC_RX_ACK,
+};
+
+struct dummy_bmc_chunk {
+	uint8_t len;
+	uint8_t buf[32];
+};
+
+struct dummy_bmc_data {
+	/* Per instance, as mode and maxblock change it. */
+	struct bmc_transport transport;
+
+	enum dummy_bmc_mode mode;
+	uint64_t boot_done;
+	uint64_t busy_until;
+
+	uint8_t *flash;
+	char *image;
+	char *version;
+
+	/* Boot loader receive state. */
+	enum dummy_bmc_rx rx_state;
+	uint8_t rx_size;
+	uint8_t rx_checksum;
+	uint8_t rx_len;
+	uint8_t rx_buf[256];
+
+	/* Boot loader command state. */
+	uint8_t status;
+	uint32_t prog_addr;
+	uint32_t prog_remaining;
+	bool restart_after_ack;
+
+	/* Responses waiting to be read by the host. */
+	struct dummy_bmc_chunk queue[DUMMY_BMC_QUEUE_LEN];
+	unsigned int queue_head;
+	unsigned int queue_count;
+
+	/* Timing model. */
+	unsigned int bus_khz;
+	unsigned int xfer_us;
+	unsigned int erase_us;
+	unsigned int program_us;
+	unsigned int boot_ms;
+	unsigned int max_block;
+	unsigned int max_packet;
+	bool legacy;
+	unsigned int fault;
+	unsigned int data_packets;
+};
+
+/*
+ * Block the caller for as long as the adapter would need to move len bytes.
+ * The fixed per-transaction overhead is only paid once per kernel call, so
+ * the second half of a combined transaction passes overhead = false.
+ */
+static void dummy_bmc_bus_time(const struct dummy_bmc_data *d, unsigned int len, bool overhead)
+{
+	unsigned int usecs = overhead ? d->xfer_us : 0;
+
+	/* Nine clocks per byte, including the ACK bit. */
+	if (d->bus_khz)
+		usecs += len * 9 * 1000 / d->bus_khz;
+	if (usecs)
+		internal_sleep(usecs);
+}
+
+static void dummy_bmc_update_mode(struct dummy_bmc_data *d)
+{
+	if (d->mode == DUMMY_BMC_BOOTING && internal_time_usecs() >= d->boot_done) {
+		msg_pdbg2("dummybmc: boot loader up.\n");
+		d->mode = DUMMY_BMC_BOOTLOADER;
+		d->rx_state = DUMMY_BMC_RX_SIZE;
+		d->queue_count = 0;
+		d->status = COMMAND_RET_SUCCESS;
+		d->prog_remaining = 0;
+		d->restart_after_ack = false;
+	}
+}
+
+static void dummy_bmc_queue(struct dummy_bmc_data *d, const uint8_t *buf, uint8_t len)
+{
+	struct dummy_bmc_chunk *chunk;
+
+	if (d->queue_count == DUMMY_BMC_QUEUE_LEN) {
+		msg_pdbg("dummybmc: response queue overflow, dropping chunk.\n");
+		return;
+	}
+	chunk = &d->queue[(d->queue_head + d->queue_count) % DUMMY_BMC_QUEUE_LEN];
+	memcpy(chunk->buf, buf, len);
+	chunk->len = len;
+	d->queue_count++;
+}
+
+static void dummy_bmc_ack(struct dummy_bmc_data *d, uint8_t ack)
+{
+	const uint8_t buf[2] = { 0x00, ack };
+
+	dummy_bmc_queue(d, buf, sizeof(buf));
+}
+
+/* Queue the status packet in the same size/checksum/data order GetPacket() reads it. */
+static void dummy_bmc_queue_status(struct dummy_bmc_data *d)
+{
+	const uint8_t size = 3;
+
+	dummy_bmc_queue(d, &size, 1);
+	/* The checksum of a one byte payload is the byte itself. */
+	dummy_bmc_queue(d, &d->status, 1);
+	dummy_bmc_queue(d, &d->status, 1);
+	d->rx_state = DUMMY_BMC_RX_ACK;
+}
+
+static void dummy_bmc_command(struct dummy_bmc_data *d)
+{
+	const uint8_t *p = d->rx_buf;
+	uint32_t busy = 0;
+	uint32_t addr, len, i;
+	uint8_t sum = 0;
+
+	for (i = 0; i < d->rx_len; i++)
+		sum += p[i];
+	if (sum != d->rx_checksum) {
+		msg_pdbg("dummybmc: bad checksum, NAK.\n");
+		dummy_bmc_ack(d, COMMAND_NAK);
+		return;
+	}
+	if (d->rx_len > d->max_packet) {
+		msg_pdbg("dummybmc: %u byte packet overflows the buffer, NAK.\n", d->rx_len);
+		dummy_bmc_ack(d, COMMAND_NAK);
+		return;
+	}
+
+	switch (p[0]) {
+	case COMMAND_PING:
+		d->status = d->rx_len == 1 ? COMMAND_RET_SUCCESS : COMMAND_RET_INVALID_CMD;
+		break;
+	case COMMAND_DOWNLOAD:
+		if (d->rx_len != 9) {
+			d->status = COMMAND_RET_INVALID_CMD;
+			break;
+		}
+		addr = (uint32_t)p[1] << 24 | p[2] << 16 | p[3] << 8 | p[4];
+		len = (uint32_t)p[5] << 24 | p[6] << 16 | p[7] << 8 | p[8];
+		if (addr % DUMMY_BMC_PAGE_SIZE || !len || len > DUMMY_BMC_FLASH_SIZE ||
+		    addr > DUMMY_BMC_FLASH_SIZE - len) {
+			d->status = COMMAND_RET_INVALID_ADDR;
+			d->prog_remaining = 0;
+			break;
+		}
+		i = (len + DUMMY_BMC_PAGE_SIZE - 1) / DUMMY_BMC_PAGE_SIZE;
+		memset(&d->flash[addr], 0xff, i * DUMMY_BMC_PAGE_SIZE);
+		msg_pdbg2("dummybmc: erased %u pages at 0x%06x.\n", i, addr);
+		busy = i * d->erase_us;
+		d->prog_addr = addr;
+		d->prog_remaining = len;
+		d->status = COMMAND_RET_SUCCESS;
+		break;
+	case COMMAND_SEND_DATA:
+		len = d->rx_len - 1;
+		if (len > d->prog_remaining) {
+			d->status = COMMAND_RET_INVALID_ADDR;
+			d->prog_remaining = 0;
+			break;
+		}
+		/* Like the real boot loader, a failure sticks until the next DOWNLOAD. */
+		if (++d->data_packets == d->fault) {
+			msg_pdbg("dummybmc: injecting a flash failure.\n");
+			d->status = COMMAND_RET_FLASH_FAIL;
+			d->prog_remaining = 0;
+			break;
+		}
+		/* NOR flash: programming can only clear bits. */
+		for (i = 0; i < len; i++)
+			d->flash[d->prog_addr + i] &= p[1 + i];
+		busy = (len + 3) / 4 * d->program_us;
+		d->prog_addr += len;
+		d->prog_remaining -= len;
+		d->status = COMMAND_RET_SUCCESS;
+		break;
+	case COMMAND_GET_STATUS:
+		dummy_bmc_ack(d, COMMAND_ACK);
+		dummy_bmc_queue_status(d);
+		return;
+	case COMMAND_RUN:
+		if (d->rx_len != 5) {
+			d->status = COMMAND_RET_INVALID_CMD;
+			break;
+		}
+		/* fall through */
+	case COMMAND_RESET:
+		d->status = COMMAND_RET_SUCCESS;
+		d->restart_after_ack = true;
+		break;
+	default:
+		d->status = COMMAND_RET_UNKNOWN_CMD;
+		break;
+	}
+
+	dummy_bmc_ack(d, COMMAND_ACK);
+	d->busy_until = internal_time_usecs() + busy;
+}
+
+static void dummy_bmc_rx_byte(struct dummy_bmc_data *d, uint8_t byte)
+{
+	switch (d->rx_state) {
+	case DUMMY_BMC_RX_ACK:
+		if (byte == COMMAND_NAK)
+			dummy_bmc_queue_status(d);
+		else if (byte == COMMAND_ACK)
+			d->rx_state = DUMMY_BMC_RX_SIZE;
+		break;
+	case DUMMY_BMC_RX_SIZE:
+		/* The boot loader skips zero bytes between packets. */
+		if (byte == 0)
+			break;
+		if (byte < 3) {
+			msg_pdbg("dummybmc: runt packet size %u.\n", byte);
+			dummy_bmc_ack(d, COMMAND_NAK);
+			break;
+		}
+		d->rx_size = byte - 2;
+		d->rx_len = 0;
+		d->rx_state = DUMMY_BMC_RX_CHECKSUM;
+		break;
+	case DUMMY_BMC_RX_CHECKSUM:
+		d->rx_checksum = byte;
+		d->rx_state = DUMMY_BMC_RX_DATA;
+		break;
+	case DUMMY_BMC_RX_DATA:
+		d->rx_buf[d->rx_len++] = byte;
+		if (d->rx_len == d->rx_size) {
+			d->rx_state = DUMMY_BMC_RX_SIZE;
+			dummy_bmc_command(d);
+		}
+		break;
+	}
+}
+
+static int32_t dummy_bmc_write(struct dummy_bmc_data *d, uint8_t const *pui8Data, uint8_t ui8Size,
+			       bool overhead)
+{
+	unsigned int i;
+
+	if (ui8Size > d->max_block)
+		return -1;
+	dummy_bmc_update_mode(d);
+	if (d->mode == DUMMY_BMC_BOOTING)
+		return -1;
+	/* Address, command code and byte count go out ahead of the data. */
+	dummy_bmc_bus_time(d, ui8Size + 3, overhead);
+	if (d->mode != DUMMY_BMC_BOOTLOADER)
+		return 0;
+	if (d->legacy && ui8Size > 1 &&
+	    (d->rx_state == DUMMY_BMC_RX_SIZE || d->rx_state == DUMMY_BMC_RX_CHECKSUM)) {
+		msg_pdbg("dummybmc: framed write rejected in legacy mode.\n");
+		dummy_bmc_ack(d, COMMAND_NAK);
+		return 0;
+	}
+	for (i = 0; i < ui8Size; i++)
+		dummy_bmc_rx_byte(d, pui8Data[i]);
+	return 0;
+}
+
+static int32_t dummy_bmc_read(struct dummy_bmc_data *d, uint8_t *pui8Data, uint8_t ui8Size,
+			      bool overhead)
+{
+	struct dummy_bmc_chunk *chunk;
+
+	dummy_bmc_update_mode(d);
+	if (d->mode == DUMMY_BMC_BOOTING)
+		return -1;
+	memset(pui8Data, 0, ui8Size);
+	if (d->mode != DUMMY_BMC_BOOTLOADER || !d->queue_count ||
+	    internal_time_usecs() < d->busy_until) {
+		dummy_bmc_bus_time(d, 5, overhead);
+		return 0;
+	}
+
+	chunk = &d->queue[d->queue_head];
+	dummy_bmc_bus_time(d, chunk->len + 4, overhead);
+	memcpy(pui8Data, chunk->buf, chunk->len < ui8Size ? chunk->len : ui8Size);
+	d->queue_head = (d->queue_head + 1) % DUMMY_BMC_QUEUE_LEN;
+	d->queue_count--;
+
+	/* RUN and RESET take effect once the host has seen the ACK. */
+	if (d->restart_after_ack && !d->queue_count) {
+		msg_pdbg2("dummybmc: leaving the boot loader.\n");
+		d->restart_after_ack = false;
+		d->mode = DUMMY_BMC_APPLICATION;
+	}
+	return 0;
+}
+
+static int32_t dummy_bmc_send_data(void *data, uint8_t const *pui8Data, uint8_t ui8Size)
+{
+	return dummy_bmc_write(data, pui8Data, ui8Size, true);
+}
+
+static int32_t dummy_bmc_receive_data(void *data, uint8_t *pui8Data, uint8_t ui8Size)
+{
+	return dummy_bmc_read(data, pui8Data, ui8Size, true);
+}
+
+/* mode=rdwr: the write and the read share one adapter transaction. */
+static int32_t dummy_bmc_exchange(void *data, uint8_t const *pui8Out, uint8_t ui8OutSize,
+				  uint8_t *pui8In, uint8_t ui8InSize)
+{
+	bool overhead = true;
+
+	if (ui8OutSize) {
+		if (dummy_bmc_write(data, pui8Out, ui8OutSize, overhead))
+			return -1;
+		overhead = false;
+	}
+	if (ui8InSize)
+		return dummy_bmc_read(data, pui8In, ui8InSize, overhead);
+	return 0;
+}
+
+static int32_t dummy_bmc_enter_bootloader(void *data, uint8_t *pui8Command, uint8_t ui8Size)
+{
+	struct dummy_bmc_data *d = data;
+
+	dummy_bmc_update_mode(d);
+	if (d->mode == DUMMY_BMC_BOOTING)
+		return -1;
+	dummy_bmc_bus_time(d, ui8Size + 2, true);
+	if (d->mode == DUMMY_BMC_APPLICATION && pui8Command[0] == COMMAND_ENTER_BOOTLOADER) {
+		msg_pdbg2("dummybmc: application restarting into the boot loader.\n");
+		d->mode = DUMMY_BMC_BOOTING;
+		d->boot_done = internal_time_usecs() + d->boot_ms * 1000;
+	}
+	return 0;
+}
+
+/* The application answers command 0x28 with its version; the boot loader does not. */
+static int32_t dummy_bmc_read_version(void *data, uint8_t *pui8Data, uint8_t ui8Size)
+{
+	struct dummy_bmc_data *d = data;
+	size_t len;
+
+	dummy_bmc_update_mode(d);
+	if (d->mode != DUMMY_BMC_APPLICATION || !d->version)
+		return -1;
+	len = strlen(d->version);
+	if (len > ui8Size)
+		len = ui8Size;
+	dummy_bmc_bus_time(d, len + 4, true);
+	memcpy(pui8Data, d->version, len);
+	return len;
+}
+
+static int dummy_bmc_shutdown(void *data)
+{
+	struct dummy_bmc_data *d = data;
+	int ret = 0;
+	FILE *f;
+
+	if (d->image) {
+		f = fopen(d->image, "wb");
+		if (!f || fwrite(d->flash, DUMMY_BMC_FLASH_SIZE, 1, f) != 1) {
+			msg_perr("dummybmc: writing \"%s\" failed: %s\n", d->image, strerror(errno));
+			ret = 1;
+		}
+		if (f && fclose(f))
+			ret = 1;
+	}
+	free(d->version);
+	free(d->image);
+	free(d->flash);
+	free(d);
+	return ret;
+}
+
+static const struct bmc_transport dummy_bmc_transport = {
+	.name			= "dummy",
+	.send_data		= dummy_bmc_send_data,
+	.receive_data		= dummy_bmc_receive_data,
+	.enter_bootloader	= dummy_bmc_enter_bootloader,
+	.read_version		= dummy_bmc_read_version,
+	.shutdown		= dummy_bmc_shutdown,
+};
+
+/* Fetch an unsigned numeric programmer parameter, leaving *value alone if it is absent. */
+static int dummy_bmc_param(const char *const *params, const char *name, unsigned int *value)
+{
+	char *arg = extract_param(params, name, ",");
+	char *endptr;
+	unsigned long tmp;
+	int ret = 0;
+
+	if (!arg)
+		return 0;
+	errno = 0;
+	tmp = strtoul(arg, &endptr, 0);
+	if (!strlen(arg) || *endptr || errno || tmp > UINT32_MAX) {
+		msg_perr("dummybmc: invalid value \"%s\" for %s.\n", arg, name);
+		ret = 1;
+	} else {
+		*value = tmp;
+	}
+	free(arg);
+	return ret;
+}
+
+int dummy_bmc_init(struct bmc_context *ctx, const char *params)
+{
+	/* extract_param() edits the string it searches, so work on a copy. */
+	char *const copy = params ? strdup(params) : NULL;
+	const char *const param = copy;
+	struct dummy_bmc_data *d;
+	char *arg;
+	FILE *f;
+
+	d = calloc(1, sizeof(*d));
+	if (d)
+		d->flash = malloc(DUMMY_BMC_FLASH_SIZE);
+	if (!d || !d->flash || (params && !copy)) {
+		msg_perr("Out of memory!\n");
+		if (d)
+			free(d->flash);
+		free(d);
+		free(copy);
+		return 1;
+	}
+	memset(d->flash, 0xff, DUMMY_BMC_FLASH_SIZE);
+
+	d->mode = DUMMY_BMC_APPLICATION;
+	d->bus_khz = 100;
+	d->xfer_us = 100;
+	d->erase_us = 8000;
+	d->program_us = 30;
+	d->boot_ms = 250;
+	d->max_block = 0;
+	d->max_packet = 80;
+	if (dummy_bmc_param(&param, "bus_khz", &d->bus_khz) ||
+	    dummy_bmc_param(&param, "xfer_us", &d->xfer_us) ||
+	    dummy_bmc_param(&param, "erase_us", &d->erase_us) ||
+	    dummy_bmc_param(&param, "program_us", &d->program_us) ||
+	    dummy_bmc_param(&param, "boot_ms", &d->boot_ms) ||
+	    dummy_bmc_param(&param, "maxblock", &d->max_block) ||
+	    dummy_bmc_param(&param, "maxpacket", &d->max_packet) ||
+	    dummy_bmc_param(&param, "fault", &d->fault))
+		goto err;
+
+	arg = extract_param(&param, "mode", ",");
+	if (arg && strcmp(arg, "rdwr") && strcmp(arg, "smbus")) {
+		msg_perr("dummybmc: mode must be \"smbus\" or \"rdwr\".\n");
+		free(arg);
+		goto err;
+	}
+	d->transport = dummy_bmc_transport;
+	if (arg && !strcmp(arg, "rdwr"))
+		d->transport.exchange = dummy_bmc_exchange;
+	if (!d->max_block)
+		d->max_block = d->transport.exchange ? 255 : 32;
+	free(arg);
+
+	arg = extract_param(&param, "legacy", ",");
+	d->legacy = arg && !strcmp(arg, "yes");
+	free(arg);
+
+	d->version = extract_param(&param, "version", ",");
+
+	d->image = extract_param(&param, "image", ",");
+	if (d->image && !strlen(d->image)) {
+		free(d->image);
+		d->image = NULL;
+	}
+	if (d->image && (f = fopen(d->image, "rb"))) {
+		if (!fread(d->flash, 1, DUMMY_BMC_FLASH_SIZE, f))
+			msg_pdbg("dummybmc: \"%s\" is empty, starting erased.\n", d->image);
+		fclose(f);
+	}
+
+	msg_pinfo("Info: Emulating a TivaC boot loader (%u kHz bus, %u us/page erase).\n",
+		  d->bus_khz, d->erase_us);
+
+	d->transport.max_transfer = d->max_block;
+	if (register_bmc_transport(ctx, &d->transport, d))
+		goto err;
+	free(copy);
+	return 0;
+err:
+	free(copy);
+	free(d->version);
+	free(d->image);
+	free(d->flash);
+	free(d);
+	return 1;
+}
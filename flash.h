@@ -61,6 +61,17 @@ void *programmer_map_flash_region(const char *descr, uintptr_t phys_addr, size_t
 void programmer_unmap_flash_region(void *virt_addr, size_t len);
 void programmer_delay(unsigned int usecs);
 
+/* How closely internal_delay() hit its targets, see udelay.c. Kept per thread. */
+struct delay_stats {
+	unsigned long count;
+	uint64_t requested_us;
+	uint64_t late_us;
+	uint64_t max_late_us;
+	uint64_t spin_us;
+};
+extern __thread struct delay_stats delay_stats;
+void print_delay_stats(void);
+
 #define ARRAY_SIZE(a) (sizeof(a) / sizeof((a)[0]))
 
 enum chipbustype {
@@ -0,0 +1,439 @@
+/*
+ * This file is part of the flashrom project.
+ *
+ * Copyright (C) 2014 Alexandre Boeglin <alex@boeglin.org>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; version 2 of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+/*
+ * The BMC on a Linux i2c-dev bus, either through SMBus block transfers or,
+ * with mode=rdwr, through raw I2C_RDWR messages.
+ *
+ * Parameters:
+ *   dev=/dev/i2c-N:ADDR  bus device and 7-bit address in hex, required
+ *   mode=smbus|rdwr      how to move the blocks, smbus by default
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/ioctl.h>
+#include <linux/i2c-dev.h>
+#include "flash.h"
+#include "bmc_update_lib.h"
+
+#ifndef I2C_FUNC_NOSTART
+#define I2C_FUNC_NOSTART I2C_FUNC_PROTOCOL_MANGLING
+#endif
+
+struct i2c_bmc_data {
+	int fd;
+	int addr;
+	bool nostart;
+};
+
+/*
+  __s32 i2c_smbus_read_block_data(int file, __u8 command, __u8 *values);
+  __s32 i2c_smbus_write_block_data(int file, __u8 command, __u8 length,  __u8 *values);
+*/
+static int32_t
+I2CSendData(void *data, uint8_t const *pui8Data, uint8_t ui8Size)
+{
+    struct i2c_bmc_data *d = data;
+    int32_t status;
+
+	status = i2c_smbus_write_block_data(d->fd, 0x21, ui8Size, pui8Data);
+    if(status>=0)  // Bytes send
+    {
+      return(0);
+    }
+
+    return(-1);
+}
+
+//*****************************************************************************
+//
+//! I2CReceiveData() receives data over a UART port.
+//!
+//! \param pui8Data is the buffer to read data into from the UART port.
+//! \param ui8Size is the number of bytes provided in pui8Data buffer that should
+//!     be written with data from the UART port.
+//!
+//! This function reads back ui8Size bytes of data from the UART port, that was
+//! opened by a call to initI2C(), into the buffer that is pointed to by
+//! pui8Data.
+//!
+//! \return This function returns zero to indicate success while any non-zero
+//!     value indicates a failure.
+//
+//*****************************************************************************
+static int32_t
+I2CReceiveData(void *data, uint8_t *pui8Data, uint8_t ui8Size)
+{
+	struct i2c_bmc_data *d = data;
+	int32_t status;
+	uint8_t smbusBuffer[I2C_SMBUS_BLOCK_MAX];
+	status = i2c_smbus_read_block_data(d->fd, 0xFF, smbusBuffer);
+	if(status < 0)
+		return (-1);
+	else {
+		uint8_t i;
+		for(i=0;i<ui8Size;i++){
+			pui8Data[i] = i < status ? smbusBuffer[i] : 0;
+		}
+	}
+    return(0);
+}
+
+//*****************************************************************************
+//
+//! I2CRawExchange() moves a block write and/or a block read in one I2C_RDWR
+//! call.
+//!
+//! \param pui8Out is the data to write as a block to command 0x21, or NULL.
+//! \param ui8OutSize is the number of bytes in pui8Out.
+//! \param pui8In is the buffer for a block read from command 0xFF, or NULL.
+//! \param ui8InSize is the number of bytes wanted in pui8In.
+//!
+//! The messages go out with repeated starts in between, so a packet and the
+//! read of its ACK take one kernel call and no bus stop. The wire format is
+//! the same as for the SMBus block transfers. If the adapter can continue a
+//! read without a new start, the payload of the read lands straight in
+//! pui8In; otherwise only the requested bytes are copied out.
+//!
+//! \return This function returns zero to indicate success while any non-zero
+//!     value indicates a failure.
+//
+//*****************************************************************************
+static int32_t
+I2CRawExchange(void *data, uint8_t const *pui8Out, uint8_t ui8OutSize,
+               uint8_t *pui8In, uint8_t ui8InSize)
+{
+	struct i2c_bmc_data *d = data;
+	struct i2c_rdwr_ioctl_data rdwr;
+	struct i2c_msg msgs[4];
+	uint8_t pui8Write[2 + 255];
+	uint8_t pui8Read[1 + 255];
+	uint8_t ui8ReadCmd = 0xFF;
+	uint8_t ui8Count;
+	int n = 0;
+
+	if(ui8OutSize) {
+		pui8Write[0] = 0x21;
+		pui8Write[1] = ui8OutSize;
+		memcpy(&pui8Write[2], pui8Out, ui8OutSize);
+		msgs[n].addr = d->addr;
+		msgs[n].flags = 0;
+		msgs[n].len = ui8OutSize + 2;
+		msgs[n].buf = pui8Write;
+		n++;
+	}
+	if(ui8InSize) {
+		msgs[n].addr = d->addr;
+		msgs[n].flags = 0;
+		msgs[n].len = 1;
+		msgs[n].buf = &ui8ReadCmd;
+		n++;
+		msgs[n].addr = d->addr;
+		msgs[n].flags = I2C_M_RD;
+		if(d->nostart) {
+			msgs[n].len = 1;
+			msgs[n].buf = &ui8Count;
+			n++;
+			msgs[n].addr = d->addr;
+			msgs[n].flags = I2C_M_RD | I2C_M_NOSTART;
+			msgs[n].len = ui8InSize;
+			msgs[n].buf = pui8In;
+		} else {
+			msgs[n].len = ui8InSize + 1;
+			msgs[n].buf = pui8Read;
+		}
+		n++;
+	}
+
+	rdwr.msgs = msgs;
+	rdwr.nmsgs = n;
+	if(ioctl(d->fd, I2C_RDWR, &rdwr) < 0)
+		return (-1);
+
+	if(ui8InSize) {
+		if(!d->nostart) {
+			ui8Count = pui8Read[0];
+			memcpy(pui8In, &pui8Read[1], ui8InSize);
+		}
+		// Bytes past the end of the block are not data.
+		if(ui8Count < ui8InSize)
+			memset(&pui8In[ui8Count], 0, ui8InSize - ui8Count);
+	}
+    return(0);
+}
+
+static int32_t
+I2CRawSendData(void *data, uint8_t const *pui8Data, uint8_t ui8Size)
+{
+	return I2CRawExchange(data, pui8Data, ui8Size, NULL, 0);
+}
+
+static int32_t
+I2CRawReceiveData(void *data, uint8_t *pui8Data, uint8_t ui8Size)
+{
+	return I2CRawExchange(data, NULL, 0, pui8Data, ui8Size);
+}
+
+//****************************************************************************
+//
+//! I2CEnterBootloader() asks the BMC application to start the boot loader.
+//!
+//! \param pui8Command is the unformatted command to send to the device.
+//! \param ui8Size is the size, in bytes, of the command to be sent.
+//!
+//! The command is sent as the SMBus command code of a block write. The caller
+//! has to give the device time to restart into the boot loader.
+//!
+//! \return If any part of the function fails, the function will return a
+//!     negative error code.  The function will return 0 to indicate success.
+//
+//****************************************************************************
+static int32_t
+I2CEnterBootloader(void *data, uint8_t *pui8Command, uint8_t ui8Size)
+{
+    struct i2c_bmc_data *d = data;
+    int32_t Status;
+    
+    if(ui8Size==1) {
+		Status = i2c_smbus_write_block_data(d->fd, pui8Command[0], 0, NULL);
+    } else {
+    	Status = i2c_smbus_write_block_data(d->fd, pui8Command[0], ui8Size--, &pui8Command[1]);
+    }
+
+	if(Status<0)  //
+    {
+        msg_pinfo("Failed to send ENTER_BOOTLOADER command\n");
+        return(-1);
+    }
+
+    return(0);
+}
+
+static int32_t
+I2CRawEnterBootloader(void *data, uint8_t *pui8Command, uint8_t ui8Size)
+{
+	struct i2c_bmc_data *d = data;
+	struct i2c_rdwr_ioctl_data rdwr;
+	struct i2c_msg msg;
+	// Same bytes as an SMBus block write of length 0.
+	uint8_t pui8Write[2] = { pui8Command[0], 0 };
+
+	msg.addr = d->addr;
+	msg.flags = 0;
+	msg.len = sizeof(pui8Write);
+	msg.buf = pui8Write;
+	rdwr.msgs = &msg;
+	rdwr.nmsgs = 1;
+	if(ioctl(d->fd, I2C_RDWR, &rdwr) < 0)
+    {
+        msg_pinfo("Failed to send ENTER_BOOTLOADER command\n");
+        return(-1);
+    }
+    return(0);
+}
+
+//****************************************************************************
+//
+//! I2CReadVersion() reads the version block of the running BMC application.
+//!
+//! \param pui8Data is the buffer for the version block.
+//! \param ui8Size is the size of pui8Data.
+//!
+//! This is the application mode SMBus block read of command 0x28. The boot
+//! loader does not answer it.
+//!
+//! \return The number of bytes stored, or a negative value on failure.
+//
+//****************************************************************************
+static int32_t
+I2CReadVersion(void *data, uint8_t *pui8Data, uint8_t ui8Size)
+{
+	struct i2c_bmc_data *d = data;
+	uint8_t smbusBuffer[I2C_SMBUS_BLOCK_MAX];
+	int32_t status;
+
+	status = i2c_smbus_read_block_data(d->fd, 0x28, smbusBuffer);
+	if (status < 0)
+		return (-1);
+	if (status > ui8Size)
+		status = ui8Size;
+	memcpy(pui8Data, smbusBuffer, status);
+	return status;
+}
+
+static int i2c_bmc_shutdown(void *data)
+{
+	struct i2c_bmc_data *d = data;
+	int ret = 0;
+
+	if (close(d->fd) < 0) {
+		msg_perr("Error closing device: errno %d.\n", errno);
+		ret = -1;
+	}
+	free(d);
+	return ret;
+}
+
+static const struct bmc_transport i2c_bmc_transport = {
+	.name			= "i2c",
+	.send_data		= I2CSendData,
+	.receive_data		= I2CReceiveData,
+	.enter_bootloader	= I2CEnterBootloader,
+	.read_version		= I2CReadVersion,
+	.shutdown		= i2c_bmc_shutdown,
+	/* i2c_smbus_write_block_data() moves at most 32 bytes. */
+	.max_transfer		= I2C_SMBUS_BLOCK_MAX,
+};
+
+static const struct bmc_transport i2c_rdwr_bmc_transport = {
+	.name			= "i2c (I2C_RDWR)",
+	.send_data		= I2CRawSendData,
+	.receive_data		= I2CRawReceiveData,
+	.exchange		= I2CRawExchange,
+	.enter_bootloader	= I2CRawEnterBootloader,
+	.read_version		= I2CReadVersion,
+	.shutdown		= i2c_bmc_shutdown,
+	/* The byte count travels in one byte. */
+	.max_transfer		= 255,
+};
+
+int i2c_bmc_init(struct bmc_context *ctx, const char *params)
+{
+	// extract_param() edits the string it searches, so work on a copy.
+	char *const copy = params ? strdup(params) : NULL;
+	const char *const param = copy;
+	const struct bmc_transport *transport = &i2c_bmc_transport;
+	struct i2c_bmc_data *d;
+	unsigned long funcs;
+	char *mode;
+	int ret = 0;
+
+	d = calloc(1, sizeof(*d));
+	if (!d || (params && !copy)) {
+		msg_perr("Out of memory!\n");
+		free(d);
+		free(copy);
+		return -1;
+	}
+
+	// mode=rdwr uses raw I2C_RDWR transfers instead of SMBus block calls.
+	mode = extract_param(&param, "mode", ",");
+	if (mode) {
+		if (!strcmp(mode, "rdwr")) {
+			transport = &i2c_rdwr_bmc_transport;
+		} else if (strcmp(mode, "smbus")) {
+			msg_perr("Error: mode must be \"smbus\" or \"rdwr\".\n");
+			free(mode);
+			free(d);
+			free(copy);
+			return -1;
+		}
+		free(mode);
+	}
+
+	// Get device, address from command-line
+	// Example: flashrom -p dev=/dev/device:address.
+	char *i2c_device = extract_param(&param, "dev", ",");
+	msg_pwarn("Warn: %s\n",i2c_device );
+	if (i2c_device != NULL && strlen(i2c_device) > 0) {
+		char *i2c_address = strchr(i2c_device, ':');
+		if (i2c_address != NULL) {
+			*i2c_address = '\0';
+			i2c_address++;
+		}
+		if (i2c_address == NULL || strlen(i2c_address) == 0) {
+			msg_perr("Error: no address specified.\n"
+				 "Use flashrom -p i2c:dev=/dev/device:address.\n");
+			ret = -1;
+			goto out;
+		}
+		d->addr = strtol(i2c_address, NULL, 16); // FIXME: error handling
+	} else {
+		msg_perr("Error: no device specified.\n"
+			 "Use flashrom -p i2c:dev=/dev/device:address.\n");
+		ret = -1;
+		goto out;
+	}
+	msg_pinfo("Info: Will try to use device %s and address 0x%02x.\n", i2c_device, d->addr);
+	snprintf(ctx->device, sizeof(ctx->device), "%s:0x%02x", i2c_device, d->addr);
+
+//	msg_pinfo("Info: Will %sreset the device at the end.\n", i2cbmc_doreset ? "" : "NOT ");
+
+	// Open device
+	if ((d->fd = open(i2c_device, O_RDWR)) < 0) {
+		switch (errno) {
+		case EACCES:
+			msg_perr("Error opening %s: Permission denied.\n"
+				 "Please use sudo or run as root.\n",
+				 i2c_device);
+			break;
+		case ENOENT:
+			msg_perr("Error opening %s: No such file.\n"
+				 "Please check you specified the correct device.\n",
+				 i2c_device);
+			break;
+		default:
+			msg_perr("Error opening %s: %s.\n", i2c_device, strerror(errno));
+		}
+		ret = -1;
+		goto out;
+	}
+	// The boot loader protocol needs SMBus block writes and reads, or
+	// plain I2C transfers to build them from.
+	if (ioctl(d->fd, I2C_FUNCS, &funcs) < 0)
+		funcs = 0;
+	if (transport == &i2c_rdwr_bmc_transport) {
+		if (!(funcs & I2C_FUNC_I2C)) {
+			msg_perr("Error: %s does not support I2C_RDWR transfers.\n", i2c_device);
+			close(d->fd);
+			ret = -1;
+			goto out;
+		}
+		d->nostart = (funcs & I2C_FUNC_NOSTART) != 0;
+	} else if ((funcs & (I2C_FUNC_SMBUS_WRITE_BLOCK_DATA | I2C_FUNC_SMBUS_READ_BLOCK_DATA)) !=
+		   (I2C_FUNC_SMBUS_WRITE_BLOCK_DATA | I2C_FUNC_SMBUS_READ_BLOCK_DATA)) {
+		msg_perr("Error: %s does not support SMBus block transfers.\n", i2c_device);
+		close(d->fd);
+		ret = -1;
+		goto out;
+	}
+	// Set slave address
+	if (ioctl(d->fd, I2C_SLAVE, d->addr) < 0) {
+		msg_perr("Error setting slave address 0x%02x: errno %d.\n",
+			 d->addr, errno);
+		close(d->fd);
+		ret = -1;
+		goto out;
+	}
+
+	ret = register_bmc_transport(ctx, transport, d);
+	if (ret)
+		close(d->fd);
+out:
+	if (ret)
+		free(d);
+	free(i2c_device);
+	free(copy);
+	return ret;
+}
@@ -22,6 +22,7 @@
 #ifndef __LIBPAYLOAD__
 
 #include <unistd.h>
+#include <errno.h>
 #include <time.h>
 #include <sys/time.h>
 #include <stdlib.h>
@@ -30,6 +31,7 @@
 
 /* loops per microsecond */
 static unsigned long micro = 1;
+static bool calibrated = false;
 
 __attribute__ ((noinline)) void myusec_delay(unsigned int usecs)
 {
@@ -168,6 +170,7 @@ recalibrate:
 	msg_pdbg("%ld myus = %ld us, ", resolution * 4, timeusec);
 
 	msg_pinfo("OK.\n");
+	calibrated = true;
 }
 
 /* Not very precise sleep. */
@@ -183,6 +186,9 @@ void internal_sleep(unsigned int usecs)
 #endif
 }
 
+__thread struct delay_stats delay_stats;
+
+#if IS_WINDOWS || defined(__DJGPP__)
 /* Precise delay. */
 void internal_delay(unsigned int usecs)
 {
@@ -190,8 +196,87 @@ void internal_delay(unsigned int usecs)
 	if (usecs > 1000000) {
 		internal_sleep(usecs);
 	} else {
+		/* Only the loop needs calibrating, so do it when it is first used. */
+		if (!calibrated)
+			myusec_calibrate_delay();
 		myusec_delay(usecs);
 	}
+	delay_stats.count++;
+	delay_stats.requested_us += usecs;
+}
+#else
+/*
+ * Wake up this long before the deadline and spin on the clock for the rest.
+ * Covers the usual timer slack and wakeup latency of an idle Linux host.
+ */
+#define DELAY_SPIN_USECS	80
+
+static uint64_t monotonic_nsecs(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/*
+ * Precise delay. Sleeps on an absolute CLOCK_MONOTONIC deadline so that
+ * signals and early wakeups don't stretch it, and only busy-waits for the
+ * last few microseconds.
+ */
+void internal_delay(unsigned int usecs)
+{
+	uint64_t end = monotonic_nsecs() + (uint64_t)usecs * 1000;
+	uint64_t now, spin_start, late;
+	struct timespec ts;
+
+	if (usecs > DELAY_SPIN_USECS) {
+		uint64_t wake = end - DELAY_SPIN_USECS * 1000;
+
+		ts.tv_sec = wake / 1000000000;
+		ts.tv_nsec = wake % 1000000000;
+		while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+			;
+	}
+	spin_start = monotonic_nsecs();
+	while ((now = monotonic_nsecs()) < end)
+		;
+
+	late = (now - end) / 1000;
+	delay_stats.count++;
+	delay_stats.requested_us += usecs;
+	delay_stats.late_us += late;
+	if (late > delay_stats.max_late_us)
+		delay_stats.max_late_us = late;
+	delay_stats.spin_us += (now - spin_start) / 1000;
+}
+#endif
+
+void print_delay_stats(void)
+{
+	if (!delay_stats.count)
+		return;
+	msg_pdbg("%lu delays, %llu us requested, %llu us late on average, %llu us at worst, "
+		 "%llu us spent spinning.\n", delay_stats.count,
+		 (unsigned long long)delay_stats.requested_us,
+		 (unsigned long long)(delay_stats.late_us / delay_stats.count),
+		 (unsigned long long)delay_stats.max_late_us,
+		 (unsigned long long)delay_stats.spin_us);
+}
+
+/* Microseconds on a monotonic clock, for measuring intervals. */
+uint64_t internal_time_usecs(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/* Millisecond delay used by the BMC boot loader protocol. */
+void delay(uint32_t mills)
+{
+	internal_delay(mills * 1000);
 }
 
 #else 